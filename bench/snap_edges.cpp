@@ -0,0 +1,98 @@
+/*******************************************************************************
+ * Snap edge search microbenchmark
+ *
+ * Cost of the snap search per motion event (snapOffset on both axes) against
+ * window count, using the kernel lwm picks at startup, and the cost of each
+ * nearest-edge kernel on its own. Every window contributes its edges, which
+ * is the worst case: at runtime only windows near the dragged one do.
+ * Built by `make bench` against lwm.cpp with LWM_NO_MAIN.
+ ******************************************************************************/
+#include "../lwm.cpp"
+
+#include <random>
+
+namespace {
+
+constexpr int    SCREEN_W = 1920;
+constexpr int    SCREEN_H = 1080;
+constexpr size_t SIZES[]  = { 10, 100, 500, 1000, 10000 };
+constexpr size_t MOTIONS  = 200000;
+
+volatile int64_t g_sink;
+
+struct Kernel {
+    const char   *name;
+    NearestEdgeFn fn;
+};
+
+} // namespace
+
+int main()
+{
+    std::vector<Kernel> kernels = { { "scalar", nearestEdgeScalar } };
+#ifdef __SSE2__
+    kernels.push_back({ "sse2", nearestEdgeSSE2 });
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({ "avx2", nearestEdgeAVX2 });
+#endif
+
+    std::mt19937 rng(42);
+    std::printf("%8s %8s %16s", "windows", "edges", "per motion ns");
+    for (const auto &k : kernels)
+        std::printf(" %12s", (std::string(k.name) + " ns").c_str());
+    std::printf("\n");
+    for (size_t n : SIZES) {
+        SnapEdges ex, ey;
+        ex.add(0, INT32_MIN / 2, INT32_MAX / 2);
+        ex.add(SCREEN_W, INT32_MIN / 2, INT32_MAX / 2);
+        ey.add(0, INT32_MIN / 2, INT32_MAX / 2);
+        ey.add(SCREEN_H, INT32_MIN / 2, INT32_MAX / 2);
+        for (size_t i = 0; i < n; i++) {
+            int w = 200 + static_cast<int>(rng() % 600), h = 150 + static_cast<int>(rng() % 450);
+            int x = static_cast<int>(rng() % (SCREEN_W - w)), y = static_cast<int>(rng() % (SCREEN_H - h));
+            ex.add(x, y, y + h);
+            ex.add(x + w, y, y + h);
+            ey.add(y, x, x + w);
+            ey.add(y + h, x, x + w);
+        }
+        // A drag of a 640x480 window across the screen.
+        std::vector<std::pair<int, int>> steps(4096);
+        for (auto &s : steps)
+            s = { static_cast<int>(rng() % (SCREEN_W - 640)), static_cast<int>(rng() % (SCREEN_H - 480)) };
+        size_t motions = std::min(MOTIONS, 400000000 / ex.size());
+
+        int64_t sum = 0;
+        uint64_t t0 = monotonicNs();
+        for (size_t i = 0; i < motions; i++) {
+            auto [x, y] = steps[i % steps.size()];
+            sum += snapOffset(ex, x, x + 640, y, y + 480);
+            sum += snapOffset(ey, y, y + 480, x, x + 640);
+        }
+        double motionNs = double(monotonicNs() - t0) / double(motions);
+        std::printf("%8zu %8zu %16.1f", n, ex.size() + ey.size(), motionNs);
+
+        int32_t expect = 0;
+        for (size_t k = 0; k < kernels.size(); k++) {
+            int32_t acc = 0;
+            t0 = monotonicNs();
+            for (size_t i = 0; i < motions; i++) {
+                auto [x, y] = steps[i % steps.size()];
+                acc ^= kernels[k].fn(ex.pos.data(), ex.lo.data(), ex.hi.data(), ex.size(),
+                                     x, y - SNAP_THRESHOLD, y + 480 + SNAP_THRESHOLD);
+            }
+            double ns = double(monotonicNs() - t0) / double(motions);
+            if (k == 0)
+                expect = acc;
+            else if (acc != expect) {
+                std::fprintf(stderr, "%s disagrees with scalar at %zu windows\n", kernels[k].name, n);
+                return 1;
+            }
+            std::printf(" %12.1f", ns);
+        }
+        std::printf("\n");
+        g_sink = sum;
+    }
+    return 0;
+}
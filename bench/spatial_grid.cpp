@@ -0,0 +1,115 @@
+/*******************************************************************************
+ * SpatialGrid microbenchmark
+ *
+ * Cost of the snap-candidate query (windows within SNAP_THRESHOLD of a moved
+ * window) against window count, for the grid and for the full scan of every
+ * client it replaced, plus the cost of moving a window in the grid and the
+ * cell size the grid picked. Two layouts: large windows piled on one 1080p
+ * screen, where most windows are candidates anyway and the grid falls back
+ * to a full pass, and smaller windows spread over a wide desktop.
+ * Built by `make bench` against lwm.cpp with LWM_NO_MAIN.
+ ******************************************************************************/
+#include "../lwm.cpp"
+
+#include <random>
+
+namespace {
+
+struct Win {
+    GridRect                   rect;
+    SpatialGrid<Win>::Hook     gridHook;
+};
+
+struct Layout {
+    const char *name;
+    int         screenW, screenH;
+    int         minW, maxW, minH, maxH;
+};
+
+constexpr Layout LAYOUTS[] = {
+    { "1920x1080, 200-800 px windows", 1920, 1080, 200, 800, 150, 600 },
+    { "7680x4320, 100-400 px windows", 7680, 4320, 100, 400, 80, 300 },
+};
+constexpr size_t SIZES[]   = { 10, 100, 1000, 10000 };
+constexpr size_t QUERIES   = 200000;
+
+volatile uint64_t g_sink;
+
+GridRect randomRect(const Layout &l, std::mt19937 &rng)
+{
+    int w = l.minW + static_cast<int>(rng() % (l.maxW - l.minW));
+    int h = l.minH + static_cast<int>(rng() % (l.maxH - l.minH));
+    return { static_cast<int>(rng() % (l.screenW - w)), static_cast<int>(rng() % (l.screenH - h)), w, h };
+}
+
+GridRect around(const GridRect &r)
+{
+    return { r.x - SNAP_THRESHOLD, r.y - SNAP_THRESHOLD,
+             r.w + 2 * SNAP_THRESHOLD, r.h + 2 * SNAP_THRESHOLD };
+}
+
+// Returns false if the grid and the scan disagree.
+bool runLayout(const Layout &l, std::mt19937 &rng)
+{
+    std::printf("%s\n%8s %14s %14s %12s %12s %8s\n", l.name, "windows", "grid query ns",
+                "full scan ns", "candidates", "move ns", "cell px");
+    for (size_t n : SIZES) {
+        std::vector<Win> wins(n);
+        SpatialGrid<Win> grid;
+        grid.resize(l.screenW, l.screenH);
+        for (auto &w : wins) {
+            w.rect = randomRect(l, rng);
+            grid.update(&w, w.rect);
+        }
+        grid.retune();
+        std::vector<GridRect> probes(1024);
+        for (auto &p : probes)
+            p = around(randomRect(l, rng));
+        // Scans are O(n); keep the large sizes quick.
+        size_t queries = std::min(QUERIES, 200000000 / n);
+
+        uint64_t found = 0, t0 = monotonicNs();
+        for (size_t i = 0; i < queries; i++)
+            grid.query(probes[i % probes.size()], [&](Win *) { found++; });
+        double gridNs = double(monotonicNs() - t0) / double(queries);
+
+        uint64_t scanned = 0;
+        t0 = monotonicNs();
+        for (size_t i = 0; i < queries; i++) {
+            const GridRect &p = probes[i % probes.size()];
+            for (const auto &w : wins)
+                scanned += w.rect.intersects(p);
+        }
+        double scanNs = double(monotonicNs() - t0) / double(queries);
+        if (found != scanned) {
+            std::fprintf(stderr, "grid and scan disagree at %zu windows\n", n);
+            return false;
+        }
+
+        // A drag step: shift one window a few pixels.
+        t0 = monotonicNs();
+        for (size_t i = 0; i < queries; i++) {
+            Win &w = wins[i % n];
+            w.rect.x = (w.rect.x + 7) % (l.screenW - w.rect.w);
+            grid.update(&w, w.rect);
+        }
+        double moveNs = double(monotonicNs() - t0) / double(queries);
+
+        g_sink = found;
+        std::printf("%8zu %14.1f %14.1f %12.1f %12.1f %8d\n", n, gridNs, scanNs,
+                    double(found) / double(queries), moveNs, grid.cellSize());
+    }
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng(42);
+    for (const Layout &l : LAYOUTS) {
+        if (!runLayout(l, rng))
+            return 1;
+    }
+    return 0;
+}
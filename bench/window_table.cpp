@@ -0,0 +1,121 @@
+/*******************************************************************************
+ * WindowTable microbenchmark
+ *
+ * Lookup, insert and erase cost of WindowTable against the containers it
+ * replaced: std::map keyed by window and a std::vector searched linearly.
+ * Built by `make bench` against lwm.cpp with LWM_NO_MAIN.
+ ******************************************************************************/
+#include "../lwm.cpp"
+
+#include <random>
+
+namespace {
+
+struct Record {
+    int16_t        x = 0, y = 0;
+    uint16_t       width = 0, height = 0;
+    uint32_t       state = 0;
+};
+
+constexpr size_t SIZES[]   = { 10, 100, 1000, 10000 };
+constexpr size_t LOOKUPS   = 1000000;
+constexpr size_t CHURN     = 100000;
+
+// Window ids look like X resource ids: a client base plus a small counter.
+std::vector<xcb_window_t> makeIds(size_t n, std::mt19937 &rng)
+{
+    std::vector<xcb_window_t> ids;
+    for (size_t i = 0; i < n; i++)
+        ids.push_back(0x00400000u + (rng() % 64) * 0x200000u + static_cast<uint32_t>(i) * 7 + 1);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+// Keeps the optimizer from dropping the loops.
+volatile uint64_t g_sink;
+
+double nsPerOp(uint64_t t0, size_t ops) { return double(monotonicNs() - t0) / double(ops); }
+
+struct Result { double lookup, churn; };
+
+Result benchTable(const std::vector<xcb_window_t> &ids, const std::vector<uint32_t> &order)
+{
+    WindowTable<Record> t;
+    for (xcb_window_t w : ids)
+        t.insert(w).state = w;
+    uint64_t sum = 0, t0 = monotonicNs();
+    for (size_t i = 0; i < LOOKUPS; i++)
+        sum += t.find(ids[order[i % order.size()]])->state;
+    double lookup = nsPerOp(t0, LOOKUPS);
+    t0 = monotonicNs();
+    for (size_t i = 0; i < CHURN; i++) {
+        xcb_window_t w = ids[order[i % order.size()]];
+        t.erase(w);
+        t.insert(w).state = w;
+    }
+    g_sink = sum;
+    return { lookup, nsPerOp(t0, CHURN) };
+}
+
+Result benchMap(const std::vector<xcb_window_t> &ids, const std::vector<uint32_t> &order)
+{
+    std::map<xcb_window_t, Record> m;
+    for (xcb_window_t w : ids)
+        m[w].state = w;
+    uint64_t sum = 0, t0 = monotonicNs();
+    for (size_t i = 0; i < LOOKUPS; i++)
+        sum += m.find(ids[order[i % order.size()]])->second.state;
+    double lookup = nsPerOp(t0, LOOKUPS);
+    t0 = monotonicNs();
+    for (size_t i = 0; i < CHURN; i++) {
+        xcb_window_t w = ids[order[i % order.size()]];
+        m.erase(w);
+        m[w].state = w;
+    }
+    g_sink = sum;
+    return { lookup, nsPerOp(t0, CHURN) };
+}
+
+// The old window list: lookups and erases are linear scans.
+Result benchVector(const std::vector<xcb_window_t> &ids, const std::vector<uint32_t> &order)
+{
+    std::vector<xcb_window_t> v(ids.begin(), ids.end());
+    std::shuffle(v.begin(), v.end(), std::mt19937(7));
+    size_t ops = std::min(LOOKUPS, 100000000 / ids.size()); // keep 10000 windows bearable
+    uint64_t sum = 0, t0 = monotonicNs();
+    for (size_t i = 0; i < ops; i++)
+        sum += *std::find(v.begin(), v.end(), ids[order[i % order.size()]]);
+    double lookup = nsPerOp(t0, ops);
+    size_t churn = std::min(CHURN, ops);
+    t0 = monotonicNs();
+    for (size_t i = 0; i < churn; i++) {
+        xcb_window_t w = ids[order[i % order.size()]];
+        v.erase(std::find(v.begin(), v.end(), w));
+        v.push_back(w);
+    }
+    g_sink = sum;
+    return { lookup, nsPerOp(t0, churn) };
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng(42);
+    std::printf("%8s  %-12s %12s %14s\n", "windows", "container", "lookup ns", "erase+insert ns");
+    for (size_t n : SIZES) {
+        std::vector<xcb_window_t> ids = makeIds(n, rng);
+        std::vector<uint32_t> order(4096);
+        for (auto &o : order)
+            o = rng() % ids.size();
+        const std::pair<const char *, Result> rows[] = {
+            { "WindowTable", benchTable(ids, order) },
+            { "std::map",    benchMap(ids, order) },
+            { "std::vector", benchVector(ids, order) },
+        };
+        for (const auto &r : rows)
+            std::printf("%8zu  %-12s %12.1f %14.1f\n", ids.size(), r.first, r.second.lookup, r.second.churn);
+    }
+    return 0;
+}
@@ -2,12 +2,15 @@
  * LWM Minimal No-Decoration Floating WM using XCB (Refactored)
  *
  * Features:
- *  - Alt+Mouse Left/Right for window move/resize (with edge snapping).
+ *  - Alt+Mouse Left/Right for window move/resize (moves snap to screen,
+ *    work-area and other windows' edges).
  *  - Alt+F toggles fullscreen.
  *  - Alt+E closes focused window (sends WM_DELETE_WINDOW if available).
  *  - Alt+Q shows an exit confirmation dialog.
  *  - Alt+R shows a "Runner" prompt (with a larger font).
- *  - Alt+Tab cycles through windows.
+ *  - Anti-aliased dialog text (XRender glyph sets, core fonts as fallback).
+ *  - Alt+Tab switches to the previously used window (repeat while holding
+ *    Alt to go further back).
  *  - Alt+I shows a help popup window with an Exit button.
  *  - Alt+M minimizes a window.
  *  - Alt+N restores all minimized windows.
@@ -17,12 +20,20 @@
  ******************************************************************************/
 
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>  // xcb_poll_for_reply
 #include <xcb/xcb_cursor.h>
 #include <xcb/xcb_keysyms.h>
 #include <xcb/xcb_icccm.h>
 #include <xcb/xcb_ewmh.h>
+#include <xcb/randr.h>
+#include <xcb/render.h>
+#include <cairo/cairo.h>
 #include <X11/keysym.h>  // for XK_ constants
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <time.h>
 
 #include <fstream>
 #include <map>
@@ -34,6 +45,9 @@
 #include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <cerrno>
 #include <algorithm>
 #include <unistd.h>
 #include <sys/types.h>
@@ -41,6 +55,14 @@
 #include <iostream>
 #include <optional>
 #include <memory>
+#include <functional>
+#include <array>
+#include <initializer_list>
+#include <climits>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // Uncomment to enable debug logs:
 //#define DEBUG_LOGS
@@ -48,6 +70,14 @@
 // Uncomment if you want “focus follows mouse” (sloppy focus):
 #define FOCUS_FOLLOWS_MOUSE
 
+// Comment out to apply every move/resize step immediately instead of at
+// most once per display refresh:
+#define PACED_DRAG
+
+// Uncomment to receive one MotionNotify hint per drag step (the pointer
+// position is then queried) instead of every motion event:
+//#define POINTER_MOTION_HINT
+
 /*******************************************************************************
  * CONSTANTS (colors, fonts, snapping threshold)
  ******************************************************************************/
@@ -55,27 +85,135 @@
 #define FOREGROUND_COLOR 0xFFFFFF   // White text
 #define HELP_BG_COLOR    0x000000   // Black background for help dialog
 
-// Font names for dialogs:
+// Dialog text is anti-aliased with XRender; the font is rasterized once at
+// startup by cairo (family and pixel size below).
+#define TEXT_FONT_FAMILY  "monospace"
+#define DEFAULT_FONT_SIZE 13.0
+#define RUNNER_FONT_SIZE  17.0       // Bigger font for Runner dialog
+
+// Core fonts used when the server has no RENDER extension:
 #define DEFAULT_FONT "9x15"
-#define RUNNER_FONT  "10x20"         // Bigger font for Runner dialog
+#define RUNNER_FONT  "10x20"
 
 // Runner dialog dimensions
 static constexpr uint16_t RUNNER_WIDTH  = 300;
 static constexpr uint16_t RUNNER_HEIGHT = 50;
+static constexpr size_t   RUNNER_MAX_INPUT = 255; // reserved up front; one text request
 
 // Help window dimensions
 static constexpr uint16_t HELP_WIDTH  = 400;
 static constexpr uint16_t HELP_HEIGHT = 240;
 
+// Exit confirmation dialog size
+static constexpr uint16_t EXIT_DIALOG_WIDTH  = 300;
+static constexpr uint16_t EXIT_DIALOG_HEIGHT = 100;
+
 // Exit button dimensions (inside help window)
 static constexpr int EXIT_BTN_X = 350;
 static constexpr int EXIT_BTN_Y = 10;
 static constexpr int EXIT_BTN_W = 40;
 static constexpr int EXIT_BTN_H = 20;
 
+// Dialog text layout
+static constexpr int TEXT_PAD     = 10; // margin between text and window edges
+static constexpr int LINE_SPACING = 5;  // extra pixels between help lines
+
 // Snapping threshold (in pixels)
 static constexpr int SNAP_THRESHOLD = 10;
 
+// Drag pacing rate used when RandR can't tell us the refresh rate (in Hz)
+#define DRAG_FALLBACK_REFRESH_HZ 60
+
+/*******************************************************************************
+ * ATOM TABLE
+ *
+ * Every atom the WM interns. setupAtoms() sends all intern requests before
+ * reading any reply; entries marked `supported` make up _NET_SUPPORTED.
+ ******************************************************************************/
+enum AtomId : size_t {
+    ATOM_WM_PROTOCOLS,
+    ATOM_WM_DELETE_WINDOW,
+    ATOM_WM_TAKE_FOCUS,
+    ATOM_NET_WM_PING,
+    ATOM_NET_SUPPORTED,
+    ATOM_NET_SUPPORTING_WM_CHECK,
+    ATOM_NET_WM_NAME,
+    ATOM_NET_ACTIVE_WINDOW,
+    ATOM_NET_WM_STATE,
+    ATOM_NET_CLIENT_LIST_STACKING,
+    ATOM_NET_WM_STRUT,
+    ATOM_NET_WM_STRUT_PARTIAL,
+    ATOM_NET_WM_WINDOW_TYPE,
+    ATOM_NET_WM_WINDOW_TYPE_DOCK,
+    // _NET_WM_STATE_* values must stay last: they double as state bits.
+    ATOM_NET_WM_STATE_FULLSCREEN,
+    ATOM_NET_WM_STATE_HIDDEN,
+    ATOM_NET_WM_STATE_ABOVE,
+    ATOM_NET_WM_STATE_BELOW,
+    ATOM_NET_WM_STATE_MAXIMIZED_VERT,
+    ATOM_NET_WM_STATE_MAXIMIZED_HORZ,
+    ATOM_NET_WM_STATE_STICKY,
+    ATOM_NET_WM_STATE_SHADED,
+    ATOM_NET_WM_STATE_MODAL,
+    ATOM_NET_WM_STATE_SKIP_TASKBAR,
+    ATOM_NET_WM_STATE_SKIP_PAGER,
+    ATOM_NET_WM_STATE_DEMANDS_ATTENTION,
+    ATOM_COUNT
+};
+
+struct AtomSpec {
+    const char *name;
+    bool        supported; // advertised in _NET_SUPPORTED
+};
+
+static constexpr AtomSpec ATOM_TABLE[] = {
+    { "WM_PROTOCOLS",                      false },
+    { "WM_DELETE_WINDOW",                  false },
+    { "WM_TAKE_FOCUS",                     false },
+    { "_NET_WM_PING",                      false },
+    { "_NET_SUPPORTED",                    false },
+    { "_NET_SUPPORTING_WM_CHECK",          true  },
+    { "_NET_WM_NAME",                      true  },
+    { "_NET_ACTIVE_WINDOW",                true  },
+    { "_NET_WM_STATE",                     true  },
+    { "_NET_CLIENT_LIST_STACKING",         true  },
+    { "_NET_WM_STRUT",                     true  },
+    { "_NET_WM_STRUT_PARTIAL",             true  },
+    { "_NET_WM_WINDOW_TYPE",               true  },
+    { "_NET_WM_WINDOW_TYPE_DOCK",          true  },
+    { "_NET_WM_STATE_FULLSCREEN",          true  },
+    { "_NET_WM_STATE_HIDDEN",              true  },
+    { "_NET_WM_STATE_ABOVE",               false },
+    { "_NET_WM_STATE_BELOW",               false },
+    { "_NET_WM_STATE_MAXIMIZED_VERT",      false },
+    { "_NET_WM_STATE_MAXIMIZED_HORZ",      false },
+    { "_NET_WM_STATE_STICKY",              false },
+    { "_NET_WM_STATE_SHADED",              false },
+    { "_NET_WM_STATE_MODAL",               false },
+    { "_NET_WM_STATE_SKIP_TASKBAR",        false },
+    { "_NET_WM_STATE_SKIP_PAGER",          false },
+    { "_NET_WM_STATE_DEMANDS_ATTENTION",   false },
+};
+static_assert(sizeof(ATOM_TABLE) / sizeof(ATOM_TABLE[0]) == ATOM_COUNT,
+              "ATOM_TABLE must have one entry per AtomId");
+
+// _NET_WM_STATE as a per-client bitset: bit i stands for the atom
+// ATOM_NET_WM_STATE_FIRST + i.
+static constexpr size_t ATOM_NET_WM_STATE_FIRST = ATOM_NET_WM_STATE_FULLSCREEN;
+static constexpr size_t NUM_NET_WM_STATES = ATOM_COUNT - ATOM_NET_WM_STATE_FIRST;
+static_assert(NUM_NET_WM_STATES <= 32, "_NET_WM_STATE bits must fit in a uint32_t");
+
+static constexpr uint32_t stateBit(AtomId id) {
+    return 1u << (id - ATOM_NET_WM_STATE_FIRST);
+}
+static constexpr uint32_t STATE_FULLSCREEN = stateBit(ATOM_NET_WM_STATE_FULLSCREEN);
+static constexpr uint32_t STATE_HIDDEN     = stateBit(ATOM_NET_WM_STATE_HIDDEN);
+
+// WM_PROTOCOLS entries we act on, cached per client.
+static constexpr uint32_t PROTO_DELETE_WINDOW = 1u << 0;
+static constexpr uint32_t PROTO_TAKE_FOCUS    = 1u << 1;
+static constexpr uint32_t PROTO_PING          = 1u << 2;
+
 /*******************************************************************************
  * RAII wrappers for XCB replies
  ******************************************************************************/
@@ -110,17 +248,35 @@ public:
             m_loggerThread.join();
     }
 
-    void log(const std::string &msg) {
+    // Parts are only joined into a message when DEBUG_LOGS is on, so
+    // release builds never build strings for the log.
+    template<typename... Parts>
+    void log(const Parts &... parts) {
 #ifndef DEBUG_LOGS
-        (void)msg; // Do nothing when debug logs are disabled.
+        ((void)parts, ...); // Do nothing when debug logs are disabled.
 #else
+        std::string msg;
+        (appendPart(msg, parts), ...);
+        report(msg);
+#endif
+    }
+
+    // Always written, even without DEBUG_LOGS (on-demand statistics dumps).
+    void report(const std::string &msg) {
         std::lock_guard<std::mutex> lock(m_mutex);
         m_queue.push(msg);
         m_cv.notify_one();
-#endif
     }
 
 private:
+    template<typename T>
+    static void appendPart(std::string &msg, const T &part) {
+        if constexpr (std::is_arithmetic_v<T>)
+            msg += std::to_string(part);
+        else
+            msg += part;
+    }
+
     void logWorker() {
         std::ofstream logFile(m_logFilePath, std::ios::out | std::ios::app);
         if (!logFile.is_open()) return;
@@ -145,23 +301,1276 @@ private:
     std::thread m_loggerThread;
 };
 
+static uint64_t monotonicNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
 /*******************************************************************************
- * Helper: Fill a window or rectangle area with a solid color.
+ * LatencyHistogram
  *
- * This function reduces code duplication when drawing the background.
+ * Handler latency in fixed log2 buckets: bucket i counts samples in
+ * [2^i, 2^(i+1)) ns. Recording never allocates.
  ******************************************************************************/
-static void fillRect(xcb_connection_t* conn, xcb_window_t win, int x, int y,
-                     int width, int height, uint32_t color) {
-    xcb_gcontext_t gc = xcb_generate_id(conn);
-    uint32_t mask = XCB_GC_FOREGROUND | XCB_GC_BACKGROUND;
-    uint32_t vals[2] = { color, color };
-    xcb_create_gc(conn, gc, win, mask, vals);
-    xcb_rectangle_t rect = { static_cast<int16_t>(x), static_cast<int16_t>(y),
-                             static_cast<uint16_t>(width), static_cast<uint16_t>(height) };
-    xcb_poly_fill_rectangle(conn, win, gc, 1, &rect);
-    xcb_free_gc(conn, gc);
+struct LatencyHistogram {
+    static constexpr int BUCKETS = 32; // the last bucket holds everything >= ~2 s
+
+    uint64_t counts[BUCKETS] = {};
+    uint64_t samples = 0;
+    uint64_t totalNs = 0;
+    uint64_t maxNs   = 0;
+
+    void record(uint64_t ns) {
+        int b = ns ? 63 - __builtin_clzll(ns) : 0;
+        counts[std::min(b, BUCKETS - 1)]++;
+        samples++;
+        totalNs += ns;
+        maxNs = std::max(maxNs, ns);
+    }
+};
+
+/*******************************************************************************
+ * EventLoop Class
+ *
+ * epoll-based main loop. The X connection, timers (timerfd) and signals
+ * (signalfd) are all plain file descriptors with a callback; nothing is
+ * polled, so an idle WM never wakes up.
+ ******************************************************************************/
+class EventLoop {
+public:
+    using Callback = std::function<void(uint32_t events)>;
+
+    EventLoop() = default;
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    ~EventLoop() {
+        for (auto &w : m_watches) {
+            if (w.second.owned)
+                close(w.first);
+        }
+        if (m_epollFd >= 0)
+            close(m_epollFd);
+    }
+
+    bool init() {
+        m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+        return m_epollFd >= 0;
+    }
+
+    // Watch an fd owned by the caller; cb receives the epoll event bits.
+    bool addFd(int fd, uint32_t events, Callback cb) {
+        return watch(fd, events, std::move(cb), false);
+    }
+
+    void removeFd(int fd) {
+        auto it = m_watches.find(fd);
+        if (it == m_watches.end()) return;
+        epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        if (it->second.owned)
+            close(fd);
+        m_watches.erase(it);
+    }
+
+    // Create a disarmed timer; returns its id (the timerfd) or -1.
+    int addTimer(std::function<void()> cb) {
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) return -1;
+        auto onExpire = [fd, cb = std::move(cb)](uint32_t) {
+            uint64_t expirations;
+            if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                cb();
+        };
+        if (!watch(fd, EPOLLIN, std::move(onExpire), true)) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Fire once after `delayNs` (and every `intervalNs` if non-zero).
+    void armTimer(int timer, uint64_t delayNs, uint64_t intervalNs = 0) {
+        itimerspec spec = {};
+        spec.it_value    = toTimespec(delayNs ? delayNs : 1);
+        spec.it_interval = toTimespec(intervalNs);
+        timerfd_settime(timer, 0, &spec, nullptr);
+    }
+
+    void disarmTimer(int timer) {
+        itimerspec spec = {};
+        timerfd_settime(timer, 0, &spec, nullptr);
+    }
+
+    // Deliver `signals` through the loop. They must already be blocked in
+    // every thread (see blockSignals), or they'd still hit their default action.
+    bool addSignals(std::initializer_list<int> signals, std::function<void(int)> cb) {
+        sigset_t set;
+        sigemptyset(&set);
+        for (int sig : signals)
+            sigaddset(&set, sig);
+        int fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd < 0) return false;
+        auto onSignal = [fd, cb = std::move(cb)](uint32_t) {
+            signalfd_siginfo si;
+            while (read(fd, &si, sizeof(si)) == sizeof(si))
+                cb(static_cast<int>(si.ssi_signo));
+        };
+        if (!watch(fd, EPOLLIN, std::move(onSignal), true)) {
+            close(fd);
+            return false;
+        }
+        return true;
+    }
+
+    static void blockSignals(std::initializer_list<int> signals) {
+        sigset_t set;
+        sigemptyset(&set);
+        for (int sig : signals)
+            sigaddset(&set, sig);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    }
+
+    // Sleep until at least one source is ready, then run its callbacks.
+    bool runOnce() {
+        epoll_event events[16];
+        int n = epoll_wait(m_epollFd, events, 16, -1);
+        if (n < 0)
+            return errno == EINTR;
+        for (int i = 0; i < n && m_running; i++) {
+            // Looked up by fd so a callback may remove other watches safely.
+            auto it = m_watches.find(events[i].data.fd);
+            if (it != m_watches.end())
+                it->second.cb(events[i].events);
+        }
+        return true;
+    }
+
+    bool running() const { return m_running; }
+    void stop() { m_running = false; }
+
+private:
+    struct Watch {
+        Callback cb;
+        bool     owned; // created (and closed) by the loop itself
+    };
+
+    bool watch(int fd, uint32_t events, Callback cb, bool owned) {
+        epoll_event ev = {};
+        ev.events  = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return false;
+        m_watches[fd] = Watch{ std::move(cb), owned };
+        return true;
+    }
+
+    static timespec toTimespec(uint64_t ns) {
+        timespec ts;
+        ts.tv_sec  = static_cast<time_t>(ns / 1000000000ull);
+        ts.tv_nsec = static_cast<long>(ns % 1000000000ull);
+        return ts;
+    }
+
+    int  m_epollFd = -1;
+    bool m_running = true;
+    std::map<int, Watch> m_watches;
+};
+
+// Signals serviced by the main loop; blocked in main() before any thread starts.
+#define LOOP_SIGNALS { SIGCHLD, SIGTERM, SIGUSR1 }
+
+/*******************************************************************************
+ * ErrorTracker Class
+ *
+ * Errors for unchecked requests arrive in the event stream. Requests worth
+ * attributing are recorded by sequence number together with the handler
+ * that sent them and an optional callback, so nothing ever has to wait in
+ * xcb_request_check. Counts are kept per major opcode and per handler.
+ ******************************************************************************/
+class ErrorTracker {
+public:
+    using Callback = void (*)(void *ctx, const xcb_generic_error_t *err);
+
+    ErrorTracker() { m_evicted.reserve(64); }
+
+    void track(unsigned int sequence, uint8_t opcode, const char *handler,
+               Callback cb = nullptr, void *ctx = nullptr) {
+        Pending &p = m_pending[sequence % RING_SIZE];
+        // The slot's previous request may still be unanswered (a long burst
+        // within one round trip); keep it aside rather than lose its callback.
+        if (p.handler && !answered(p.sequence))
+            m_evicted.push_back(p);
+        p = { sequence, opcode, handler, cb, ctx };
+    }
+
+    // Every event carries the sequence of the last request the server had
+    // processed; an error for an earlier request can no longer arrive.
+    void retire(unsigned int sequence) {
+        m_lastSeen = sequence;
+        m_seenAny  = true;
+        if (m_evicted.empty())
+            return;
+        m_evicted.erase(std::remove_if(m_evicted.begin(), m_evicted.end(),
+                                       [this](const Pending &p) { return answered(p.sequence); }),
+                        m_evicted.end());
+    }
+
+    // Attribute an error and run its callback, if the request was tracked.
+    void onError(const xcb_generic_error_t *err) {
+        m_total++;
+        m_perOpcode[err->major_code]++;
+        Pending *p = &m_pending[err->full_sequence % RING_SIZE];
+        if (!matches(*p, err)) {
+            p = nullptr;
+            for (Pending &e : m_evicted) {
+                if (matches(e, err)) {
+                    p = &e;
+                    break;
+                }
+            }
+        }
+        if (p) {
+            m_perHandler[p->handler]++;
+            Callback cb  = p->cb;
+            void    *ctx = p->ctx;
+            if (p >= m_evicted.data() && p < m_evicted.data() + m_evicted.size()) {
+                *p = m_evicted.back();
+                m_evicted.pop_back();
+            } else {
+                *p = {};
+            }
+            if (cb)
+                cb(ctx, err);
+        } else {
+            m_perHandler["(untracked)"]++;
+        }
+    }
+
+    void report(Logger &logger) const {
+        logger.report("  X errors: " + std::to_string(m_total));
+        for (size_t op = 0; op < m_perOpcode.size(); op++) {
+            if (m_perOpcode[op])
+                logger.report("    opcode " + std::to_string(op) + ": "
+                              + std::to_string(m_perOpcode[op]));
+        }
+        for (const auto &h : m_perHandler)
+            logger.report("    " + h.first + ": " + std::to_string(h.second));
+    }
+
+private:
+    // Slots are indexed by sequence number, so a slot is reused by any tracked
+    // request RING_SIZE sequence numbers later, tracked or not in between.
+    // Bursts longer than that within one round trip spill into m_evicted.
+    static constexpr size_t RING_SIZE = 1024;
+    struct Pending {
+        unsigned int sequence = 0;
+        uint8_t      opcode   = 0;
+        const char  *handler  = nullptr;
+        Callback     cb       = nullptr;
+        void        *ctx      = nullptr;
+    };
+    static bool matches(const Pending &p, const xcb_generic_error_t *err) {
+        return p.handler && p.sequence == err->full_sequence && p.opcode == err->major_code;
+    }
+
+    // Strictly before the last processed request: its error would have come.
+    bool answered(unsigned int sequence) const {
+        return m_seenAny && static_cast<int32_t>(sequence - m_lastSeen) < 0;
+    }
+
+    Pending                         m_pending[RING_SIZE] = {};
+    std::vector<Pending>            m_evicted;  // unanswered entries displaced from the ring
+    unsigned int                    m_lastSeen = 0;
+    bool                            m_seenAny  = false;
+    std::array<uint64_t, 256>       m_perOpcode = {};
+    std::map<std::string, uint64_t> m_perHandler;
+    uint64_t                        m_total = 0;
+};
+
+/*******************************************************************************
+ * ScratchArena Class
+ *
+ * Bump allocator for temporary data that lives until the end of the current
+ * event batch (reset() in flushBatch). Requests that don't fit are served
+ * from the heap and the arena grows at the next reset, so a steady workload
+ * stops allocating after its first large batch.
+ ******************************************************************************/
+class ScratchArena {
+public:
+    explicit ScratchArena(size_t capacity = 16 * 1024)
+        : m_buf(new char[capacity]), m_capacity(capacity) {}
+
+    template<typename T>
+    T *alloc(size_t n) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena memory is never destroyed");
+        size_t off   = (m_used + alignof(T) - 1) & ~(alignof(T) - 1);
+        size_t bytes = n * sizeof(T);
+        if (off + bytes > m_capacity) {
+            m_overflow.emplace_back(new char[bytes]);
+            m_overflowBytes += bytes;
+            return reinterpret_cast<T*>(m_overflow.back().get());
+        }
+        m_used = off + bytes;
+        return reinterpret_cast<T*>(m_buf.get() + off);
+    }
+
+    void reset() {
+        if (!m_overflow.empty()) {
+            m_capacity = 2 * (m_capacity + m_overflowBytes);
+            m_buf.reset(new char[m_capacity]);
+            m_overflow.clear();
+            m_overflowBytes = 0;
+        }
+        m_used = 0;
+    }
+
+    size_t capacity() const { return m_capacity; }
+
+private:
+    std::unique_ptr<char[]>              m_buf;
+    size_t                               m_capacity;
+    size_t                               m_used = 0;
+    std::vector<std::unique_ptr<char[]>> m_overflow;
+    size_t                               m_overflowBytes = 0;
+};
+
+/*******************************************************************************
+ * Allocation check (make ALLOC_CHECK=1)
+ *
+ * Counts heap allocations made on the WM thread; operator new lands in
+ * malloc too. dispatchEvent() aborts when a move, focus change or key press
+ * allocates, unless the code path is wrapped in an AllocExempt scope (only
+ * fork/exec for the runner). Dialogs use records made at startup.
+ * Relies on glibc's __libc_* entry points.
+ ******************************************************************************/
+#ifdef ALLOC_CHECK
+#ifdef DEBUG_LOGS
+#error "ALLOC_CHECK counts the allocations DEBUG_LOGS makes; build without it"
+#endif
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static thread_local uint64_t t_allocCount  = 0;
+static thread_local unsigned t_allocExempt = 0;
+
+extern "C" void *malloc(size_t size) {
+    if (!t_allocExempt) t_allocCount++;
+    return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t n, size_t size) {
+    if (!t_allocExempt) t_allocCount++;
+    return __libc_calloc(n, size);
+}
+extern "C" void *realloc(void *ptr, size_t size) {
+    if (!t_allocExempt) t_allocCount++;
+    return __libc_realloc(ptr, size);
+}
+
+struct AllocExempt {
+    AllocExempt()  { t_allocExempt++; }
+    ~AllocExempt() { t_allocExempt--; }
+};
+#else
+struct AllocExempt {
+    AllocExempt() {}
+};
+#endif
+
+/*******************************************************************************
+ * WindowTable Class
+ *
+ * Open-addressing hash table from window id to an owned record. Linear
+ * probing over a power-of-two array with backward-shift deletion keeps
+ * probe runs short without tombstones. Records are allocated once and never
+ * move, so pointers to them stay valid until erase().
+ ******************************************************************************/
+template<typename T>
+class WindowTable {
+public:
+    WindowTable() { rehash(MIN_CAPACITY); }
+
+    T *find(xcb_window_t w) const {
+        if (w == XCB_NONE)
+            return nullptr;
+        for (size_t i = home(w);; i = next(i)) {
+            if (m_slots[i].key == w)        return m_slots[i].value.get();
+            if (m_slots[i].key == XCB_NONE) return nullptr;
+        }
+    }
+
+    // Record for w, default-constructed if it wasn't there yet.
+    T &insert(xcb_window_t w) {
+        if (T *t = find(w))
+            return *t;
+        return adopt(w, std::make_unique<T>());
+    }
+
+    // Takes over a record allocated elsewhere; w must not be present. Does
+    // not allocate while size() stays within what reserve() asked for.
+    T &adopt(xcb_window_t w, std::unique_ptr<T> value) {
+        if ((m_size + 1) * 2 > m_slots.size()) // keep load factor <= 1/2
+            rehash(m_slots.size() * 2);
+        size_t i = home(w);
+        while (m_slots[i].key != XCB_NONE)
+            i = next(i);
+        m_slots[i].key   = w;
+        m_slots[i].value = std::move(value);
+        m_size++;
+        return *m_slots[i].value;
+    }
+
+    bool erase(xcb_window_t w) {
+        return release(w) != nullptr;
+    }
+
+    // Removes w and hands its record back instead of freeing it.
+    std::unique_ptr<T> release(xcb_window_t w) {
+        if (w == XCB_NONE)
+            return nullptr;
+        size_t i = home(w);
+        for (;; i = next(i)) {
+            if (m_slots[i].key == XCB_NONE) return nullptr;
+            if (m_slots[i].key == w)        break;
+        }
+        std::unique_ptr<T> value = std::move(m_slots[i].value);
+        m_slots[i] = Slot{};
+        // Pull later members of the probe run into the hole, unless that
+        // would place them before their home slot.
+        for (size_t j = next(i); m_slots[j].key != XCB_NONE; j = next(j)) {
+            size_t h = home(m_slots[j].key);
+            if (((j - h) & mask()) >= ((j - i) & mask())) {
+                m_slots[i] = std::move(m_slots[j]);
+                m_slots[j] = Slot{};
+                i = j;
+            }
+        }
+        m_size--;
+        return value;
+    }
+
+    // Room for n records without rehashing.
+    void reserve(size_t n) {
+        size_t capacity = m_slots.size();
+        while (n * 2 > capacity)
+            capacity *= 2;
+        if (capacity != m_slots.size())
+            rehash(capacity);
+    }
+
+    size_t size() const { return m_size; }
+
+private:
+    static constexpr size_t MIN_CAPACITY = 64;
+    struct Slot {
+        xcb_window_t       key = XCB_NONE;
+        std::unique_ptr<T> value;
+    };
+
+    // Fibonacci hashing: window ids come in dense runs per client, which
+    // the multiply spreads over the whole table.
+    size_t home(xcb_window_t w) const {
+        return static_cast<size_t>((static_cast<uint64_t>(w) * 0x9E3779B97F4A7C15ull) >> m_shift);
+    }
+    size_t next(size_t i) const { return (i + 1) & mask(); }
+    size_t mask() const { return m_slots.size() - 1; }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> old(capacity);
+        old.swap(m_slots);
+        m_shift = 64;
+        for (size_t c = capacity; c > 1; c >>= 1)
+            m_shift--;
+        for (auto &s : old) {
+            if (s.key == XCB_NONE)
+                continue;
+            size_t i = home(s.key);
+            while (m_slots[i].key != XCB_NONE)
+                i = next(i);
+            m_slots[i] = std::move(s);
+        }
+    }
+
+    std::vector<Slot> m_slots;
+    size_t            m_size  = 0;
+    unsigned          m_shift = 64;
+};
+
+/*******************************************************************************
+ * SpatialGrid Class
+ *
+ * Loose grid over the screen for rectangle queries on client geometry. Each
+ * object is listed once, in the cell holding its top-left corner, so a query
+ * looks at the cells up to one cell size above and left of its rectangle.
+ * Objects larger than a cell go in an oversize cell every query reads. The
+ * cell size follows the windows (retune()).
+ *
+ * Rectangles are packed in one array sorted by cell, row by row, so the
+ * cells a query covers in one row are a single contiguous run, and a query
+ * that would cover nearly everything reads the whole array in one pass
+ * instead. An object changing cells is swapped across the cell boundaries
+ * in between, one swap per boundary. Once reserve() has made room for the
+ * object count, neither updates nor queries allocate.
+ ******************************************************************************/
+struct GridRect {
+    int x, y, w, h;
+    bool intersects(const GridRect &o) const {
+        return x < o.x + o.w && o.x < x + w && y < o.y + o.h && o.y < y + h;
+    }
+};
+
+template<typename T>
+class SpatialGrid {
+public:
+    static constexpr uint32_t UNLISTED = UINT32_MAX;
+
+    struct Hook {
+        uint32_t slot = UNLISTED; // index into the packed arrays
+        uint32_t cell = 0;
+    };
+
+    SpatialGrid() { rebuild(m_shift); }
+
+    // Re-lists every object for the new screen size.
+    void resize(int width, int height) {
+        m_width  = width;
+        m_height = height;
+        rebuild(m_shift);
+    }
+
+    // Picks the power-of-two cell size, at most a quarter of the screen,
+    // that minimises the objects an average window's query reads: the
+    // oversize ones plus those starting in the cells it covers. Rebuilds
+    // the cells when that changes, so call it when windows are added, not
+    // while they move.
+    void retune() {
+        if (m_rects.empty())
+            return;
+        int maxShift = MIN_CELL_SHIFT;
+        while ((2 << maxShift) <= std::max(m_width, m_height) / 4)
+            maxShift++;
+        size_t fits[32] = {}; // objects first fitting a 1 << shift cell
+        double meanW = 0, meanH = 0;
+        for (const GridRect &r : m_rects) {
+            int shift = MIN_CELL_SHIFT;
+            while (shift <= maxShift && std::max(r.w, r.h) > (1 << shift))
+                shift++;
+            fits[shift]++;
+            meanW += r.w;
+            meanH += r.h;
+        }
+        const double n = static_cast<double>(m_rects.size());
+        meanW /= n;
+        meanH /= n;
+        const double area = std::max(1.0, static_cast<double>(m_width) * m_height);
+        int best = m_shift;
+        double bestCost = -1, fitting = 0;
+        for (int shift = MIN_CELL_SHIFT; shift <= maxShift; shift++) {
+            fitting += fits[shift];
+            double cell = 1 << shift;
+            double cost = (n - fitting) + fitting * std::min(1.0, (meanW + 2 * cell) * (meanH + 2 * cell) / area);
+            if (bestCost < 0 || cost <= bestCost) { // larger cells on ties
+                best = shift;
+                bestCost = cost;
+            }
+        }
+        if (best != m_shift)
+            rebuild(best);
+    }
+
+    // Room for n objects, so adding one does not allocate.
+    void reserve(size_t n) {
+        if (n <= m_objects.capacity())
+            return;
+        n = std::max(n, m_objects.capacity() * 2);
+        m_objects.reserve(n);
+        m_rects.reserve(n);
+    }
+
+    void update(T *obj, const GridRect &r) {
+        Hook &h = obj->gridHook;
+        if (h.slot == UNLISTED) {
+            // Appended to the last cell, the oversize one.
+            h.slot = static_cast<uint32_t>(m_objects.size());
+            h.cell = oversizeCell();
+            m_objects.push_back(obj);
+            m_rects.push_back(r);
+            m_start.back()++;
+        }
+        m_rects[h.slot] = r;
+        move(obj, cellOf(r));
+    }
+
+    void remove(T *obj) {
+        Hook &h = obj->gridHook;
+        if (h.slot == UNLISTED)
+            return;
+        move(obj, oversizeCell());
+        swapSlots(h.slot, static_cast<uint32_t>(m_objects.size() - 1));
+        m_objects.pop_back();
+        m_rects.pop_back();
+        m_start.back()--;
+        h.slot = UNLISTED;
+    }
+
+    const GridRect &rect(const T *obj) const { return m_rects[obj->gridHook.slot]; }
+    int cellSize() const { return 1 << m_shift; }
+
+    // Calls f(obj) once for every object whose rectangle intersects r.
+    // f must not update or remove objects.
+    template<typename F>
+    void query(const GridRect &r, F &&f) {
+        // An intersecting object starts less than a cell before r.
+        int cx0 = cellX(r.x - (1 << m_shift) + 1), cx1 = cellX(r.x + std::max(r.w, 1) - 1);
+        int cy0 = cellY(r.y - (1 << m_shift) + 1), cy1 = cellY(r.y + std::max(r.h, 1) - 1);
+        const uint32_t oversize = oversizeCell();
+        size_t listed = m_start[oversize + 1] - m_start[oversize];
+        for (int cy = cy0; cy <= cy1 && listed * 2 < m_rects.size(); cy++)
+            listed += m_start[cy * m_cols + cx1 + 1] - m_start[cy * m_cols + cx0];
+        if (listed * 2 >= m_rects.size()) {
+            scan(0, static_cast<uint32_t>(m_rects.size()), r, f);
+            return;
+        }
+        for (int cy = cy0; cy <= cy1; cy++)
+            scan(m_start[cy * m_cols + cx0], m_start[cy * m_cols + cx1 + 1], r, f);
+        scan(m_start[oversize], m_start[oversize + 1], r, f);
+    }
+
+private:
+    static constexpr int MIN_CELL_SHIFT = 6; // 64 px
+
+    template<typename F>
+    void scan(uint32_t begin, uint32_t end, const GridRect &r, F &f) {
+        for (uint32_t i = begin; i < end; i++) {
+            if (m_rects[i].intersects(r))
+                f(m_objects[i]);
+        }
+    }
+
+    // Shifts floor negative coordinates too; off-screen objects clamp to
+    // the border cells, which the query's range then always includes.
+    int cellX(int x) const { return std::clamp(x >> m_shift, 0, m_cols - 1); }
+    int cellY(int y) const { return std::clamp(y >> m_shift, 0, m_rows - 1); }
+    uint32_t oversizeCell() const { return static_cast<uint32_t>(m_cols * m_rows); }
+
+    uint32_t cellOf(const GridRect &r) const {
+        if (r.w > (1 << m_shift) || r.h > (1 << m_shift))
+            return oversizeCell();
+        return static_cast<uint32_t>(cellY(r.y) * m_cols + cellX(r.x));
+    }
+
+    void swapSlots(uint32_t a, uint32_t b) {
+        std::swap(m_objects[a], m_objects[b]);
+        std::swap(m_rects[a], m_rects[b]);
+        m_objects[a]->gridHook.slot = a;
+        m_objects[b]->gridHook.slot = b;
+    }
+
+    // Walks obj to the edge of its cell, shifts that boundary past it, and
+    // repeats until it is in `to`.
+    void move(T *obj, uint32_t to) {
+        Hook &h = obj->gridHook;
+        for (; h.cell < to; h.cell++) {
+            swapSlots(h.slot, m_start[h.cell + 1] - 1);
+            m_start[h.cell + 1]--;
+        }
+        for (; h.cell > to; h.cell--) {
+            swapSlots(h.slot, m_start[h.cell]);
+            m_start[h.cell]++;
+        }
+    }
+
+    // Counting sort of every object into the cells for `shift`.
+    void rebuild(int shift) {
+        m_shift = shift;
+        m_cols  = std::max(1, (m_width + (1 << shift) - 1) >> shift);
+        m_rows  = std::max(1, (m_height + (1 << shift) - 1) >> shift);
+        m_start.assign(oversizeCell() + 2, 0);
+        for (T *obj : m_objects) {
+            obj->gridHook.cell = cellOf(m_rects[obj->gridHook.slot]);
+            m_start[obj->gridHook.cell + 1]++;
+        }
+        for (size_t c = 1; c < m_start.size(); c++)
+            m_start[c] += m_start[c - 1];
+        std::vector<T*>       objects(m_objects.size());
+        std::vector<GridRect> rects(m_rects.size());
+        std::vector<uint32_t> next(m_start.begin(), m_start.end() - 1);
+        for (size_t i = 0; i < m_objects.size(); i++) {
+            Hook &h = m_objects[i]->gridHook;
+            h.slot = next[h.cell]++;
+            objects[h.slot] = m_objects[i];
+            rects[h.slot]   = m_rects[i];
+        }
+        objects.reserve(m_objects.capacity());
+        rects.reserve(m_rects.capacity());
+        m_objects.swap(objects);
+        m_rects.swap(rects);
+    }
+
+    std::vector<uint32_t> m_start;   // first slot of each cell, then the oversize cell, then the end
+    std::vector<T*>       m_objects; // per slot, sorted by cell
+    std::vector<GridRect> m_rects;
+    int m_width  = 0;
+    int m_height = 0;
+    int m_shift  = 8;
+    int m_cols   = 1;
+    int m_rows   = 1;
+};
+
+/*******************************************************************************
+ * SNAP EDGE SEARCH
+ *
+ * Candidate edges for one axis are kept structure-of-arrays: the edge's
+ * coordinate on the snapping axis and the span it covers on the other one.
+ * nearestEdge() finds the closest edge to a target coordinate among those
+ * whose span overlaps the dragged window's, returning a key that orders by
+ * distance: (|delta| << 1) | (delta < 0), or INT32_MAX if none qualifies.
+ ******************************************************************************/
+struct SnapEdges {
+    std::vector<int32_t> pos;
+    std::vector<int32_t> lo;
+    std::vector<int32_t> hi;
+
+    void clear() { pos.clear(); lo.clear(); hi.clear(); }
+    void reserve(size_t n) { pos.reserve(n); lo.reserve(n); hi.reserve(n); }
+    void truncate(size_t n) { pos.resize(n); lo.resize(n); hi.resize(n); }
+    void add(int32_t p, int32_t l, int32_t h) {
+        pos.push_back(p);
+        lo.push_back(l);
+        hi.push_back(h);
+    }
+    size_t size() const { return pos.size(); }
+};
+
+using NearestEdgeFn = int32_t (*)(const int32_t *pos, const int32_t *lo, const int32_t *hi,
+                                  size_t n, int32_t target, int32_t spanLo, int32_t spanHi);
+
+static inline int32_t edgeKey(int32_t d) {
+    return (std::abs(d) << 1) | (d < 0);
+}
+
+static int32_t nearestEdgeScalar(const int32_t *pos, const int32_t *lo, const int32_t *hi,
+                                 size_t n, int32_t target, int32_t spanLo, int32_t spanHi)
+{
+    int32_t best = INT32_MAX;
+    for (size_t i = 0; i < n; i++) {
+        if (lo[i] < spanHi && spanLo < hi[i])
+            best = std::min(best, edgeKey(pos[i] - target));
+    }
+    return best;
+}
+
+#ifdef __SSE2__
+// SSE2 has no 32-bit abs or min: both are built from compares and masks.
+static int32_t nearestEdgeSSE2(const int32_t *pos, const int32_t *lo, const int32_t *hi,
+                               size_t n, int32_t target, int32_t spanLo, int32_t spanHi)
+{
+    const __m128i t    = _mm_set1_epi32(target);
+    const __m128i sLo  = _mm_set1_epi32(spanLo);
+    const __m128i sHi  = _mm_set1_epi32(spanHi);
+    const __m128i none = _mm_set1_epi32(INT32_MAX);
+    __m128i best = none;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i d    = _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos + i)), t);
+        __m128i sign = _mm_srai_epi32(d, 31);
+        __m128i key  = _mm_or_si128(_mm_slli_epi32(_mm_sub_epi32(_mm_xor_si128(d, sign), sign), 1),
+                                    _mm_srli_epi32(d, 31));
+        __m128i ok   = _mm_and_si128(
+            _mm_cmpgt_epi32(sHi, _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo + i))),
+            _mm_cmpgt_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hi + i)), sLo));
+        key = _mm_or_si128(_mm_and_si128(ok, key), _mm_andnot_si128(ok, none));
+        __m128i lt = _mm_cmpgt_epi32(best, key);
+        best = _mm_or_si128(_mm_and_si128(lt, key), _mm_andnot_si128(lt, best));
+    }
+    alignas(16) int32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), best);
+    int32_t r = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    return std::min(r, nearestEdgeScalar(pos + i, lo + i, hi + i, n - i, target, spanLo, spanHi));
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int32_t nearestEdgeAVX2(const int32_t *pos, const int32_t *lo, const int32_t *hi,
+                               size_t n, int32_t target, int32_t spanLo, int32_t spanHi)
+{
+    const __m256i t    = _mm256_set1_epi32(target);
+    const __m256i sLo  = _mm256_set1_epi32(spanLo);
+    const __m256i sHi  = _mm256_set1_epi32(spanHi);
+    const __m256i none = _mm256_set1_epi32(INT32_MAX);
+    __m256i best = none;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i d   = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos + i)), t);
+        __m256i key = _mm256_or_si256(_mm256_slli_epi32(_mm256_abs_epi32(d), 1),
+                                      _mm256_srli_epi32(d, 31));
+        __m256i ok  = _mm256_and_si256(
+            _mm256_cmpgt_epi32(sHi, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lo + i))),
+            _mm256_cmpgt_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(hi + i)), sLo));
+        best = _mm256_min_epi32(best, _mm256_blendv_epi8(none, key, ok));
+    }
+    alignas(32) int32_t lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), best);
+    int32_t r = INT32_MAX;
+    for (int32_t v : lanes)
+        r = std::min(r, v);
+    return std::min(r, nearestEdgeScalar(pos + i, lo + i, hi + i, n - i, target, spanLo, spanHi));
+}
+#endif
+
+static NearestEdgeFn pickNearestEdge()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return nearestEdgeAVX2;
+#endif
+#ifdef __SSE2__
+    return nearestEdgeSSE2;
+#else
+    return nearestEdgeScalar;
+#endif
+}
+static const NearestEdgeFn nearestEdge = pickNearestEdge();
+
+// Offset that snaps [a, b] onto the closest edge within SNAP_THRESHOLD whose
+// span comes near [spanLo, spanHi], or 0.
+static int snapOffset(const SnapEdges &e, int a, int b, int spanLo, int spanHi)
+{
+    spanLo -= SNAP_THRESHOLD;
+    spanHi += SNAP_THRESHOLD;
+    int32_t key = std::min(
+        nearestEdge(e.pos.data(), e.lo.data(), e.hi.data(), e.size(), a, spanLo, spanHi),
+        nearestEdge(e.pos.data(), e.lo.data(), e.hi.data(), e.size(), b, spanLo, spanHi));
+    int32_t dist = key >> 1;
+    if (key == INT32_MAX || dist >= SNAP_THRESHOLD)
+        return 0;
+    return (key & 1) ? -dist : dist;
 }
 
+/*******************************************************************************
+ * DamageRegion
+ *
+ * Exposed rectangles of one window, gathered until the last Expose of a
+ * series (count == 0). Fixed capacity; on overflow the region collapses to
+ * its bounding box, which only ever repaints more than needed.
+ ******************************************************************************/
+struct DamageRegion {
+    static constexpr size_t MAX_RECTS = 16;
+    xcb_rectangle_t rects[MAX_RECTS];
+    size_t          count = 0;
+
+    void add(const xcb_rectangle_t &r) {
+        if (count == MAX_RECTS) {
+            rects[0] = bounds();
+            count = 1;
+        }
+        rects[count++] = r;
+    }
+    xcb_rectangle_t bounds() const {
+        int x0 = rects[0].x, y0 = rects[0].y;
+        int x1 = x0 + rects[0].width, y1 = y0 + rects[0].height;
+        for (size_t i = 1; i < count; i++) {
+            x0 = std::min<int>(x0, rects[i].x);
+            y0 = std::min<int>(y0, rects[i].y);
+            x1 = std::max<int>(x1, rects[i].x + rects[i].width);
+            y1 = std::max<int>(y1, rects[i].y + rects[i].height);
+        }
+        return { static_cast<int16_t>(x0), static_cast<int16_t>(y0),
+                 static_cast<uint16_t>(x1 - x0), static_cast<uint16_t>(y1 - y0) };
+    }
+    void clear() { count = 0; }
+};
+
+/*******************************************************************************
+ * RenderContext Class
+ *
+ * Server-side resources for drawing the dialogs, created once at startup:
+ * the dialog fonts with their metrics, one text GC per (font, fg, bg) and a
+ * single fill GC whose foreground is only changed when it differs.
+ ******************************************************************************/
+class RenderContext {
+public:
+    enum FontId { FONT_DEFAULT, FONT_RUNNER, FONT_COUNT };
+
+    struct FontMetrics {
+        int ascent    = 12;
+        int descent   = 3;
+        int charWidth = 8;
+        int height() const { return ascent + descent; }
+    };
+
+    void init(xcb_connection_t *conn, const xcb_screen_t *screen) {
+        m_conn = conn;
+        m_root = screen->root;
+        // Glyphs are uploaded here, so the first dialog draws without loading anything.
+        m_useRender = initGlyphs(screen->root_visual);
+        // Sized up front so a dialog opened from a key handler never grows them.
+        m_textGCs.reserve(CACHE_CAPACITY);
+        m_targets.reserve(CACHE_CAPACITY);
+        m_fills.reserve(CACHE_CAPACITY);
+        if (!m_useRender)
+            initCoreFonts();
+        m_fillGC = xcb_generate_id(m_conn);
+        xcb_create_gc(m_conn, m_fillGC, m_root, XCB_GC_FOREGROUND, &m_fillFg);
+        // Pixmaps are never obscured: no GraphicsExpose/NoExpose per copy.
+        uint32_t noExposures = 0;
+        m_copyGC = xcb_generate_id(m_conn);
+        xcb_create_gc(m_conn, m_copyGC, m_root, XCB_GC_GRAPHICS_EXPOSURES, &noExposures);
+    }
+
+    void cleanup() {
+        if (!m_conn)
+            return;
+        for (const auto &t : m_textGCs)
+            xcb_free_gc(m_conn, t.gc);
+        m_textGCs.clear();
+        for (const auto &t : m_targets)
+            xcb_render_free_picture(m_conn, t.picture);
+        m_targets.clear();
+        for (const auto &s : m_fills)
+            xcb_render_free_picture(m_conn, s.picture);
+        m_fills.clear();
+        for (int f = 0; f < FONT_COUNT; f++) {
+            if (m_glyphSets[f] != XCB_NONE)
+                xcb_render_free_glyph_set(m_conn, m_glyphSets[f]);
+            if (m_fonts[f] != XCB_NONE)
+                xcb_close_font(m_conn, m_fonts[f]);
+        }
+        xcb_free_gc(m_conn, m_fillGC);
+        xcb_free_gc(m_conn, m_copyGC);
+        m_conn = nullptr;
+    }
+
+    const FontMetrics &metrics(FontId f) const { return m_metrics[f]; }
+    int textWidth(FontId f, size_t len) const { return static_cast<int>(len) * m_metrics[f].charWidth; }
+
+    void fillRect(xcb_drawable_t d, int x, int y, int width, int height, uint32_t color) {
+        if (color != m_fillFg) {
+            xcb_change_gc(m_conn, m_fillGC, XCB_GC_FOREGROUND, &color);
+            m_fillFg = color;
+        }
+        xcb_rectangle_t rect = { static_cast<int16_t>(x), static_cast<int16_t>(y),
+                                 static_cast<uint16_t>(width), static_cast<uint16_t>(height) };
+        xcb_poly_fill_rectangle(m_conn, d, m_fillGC, 1, &rect);
+    }
+
+    void copyArea(xcb_drawable_t src, xcb_drawable_t dst, int x, int y, int width, int height) {
+        unclip();
+        xcb_copy_area(m_conn, src, dst, m_copyGC, x, y, x, y, width, height);
+    }
+
+    // One copy of the region's bounding box, clipped to its rectangles.
+    void copyRegion(xcb_drawable_t src, xcb_drawable_t dst, const DamageRegion &region) {
+        if (region.count == 0)
+            return;
+        xcb_rectangle_t b = region.bounds();
+        if (region.count == 1) {
+            copyArea(src, dst, b.x, b.y, b.width, b.height);
+            return;
+        }
+        xcb_set_clip_rectangles(m_conn, XCB_CLIP_ORDERING_UNSORTED, m_copyGC, 0, 0,
+                                region.count, region.rects);
+        m_copyClipped = true;
+        xcb_copy_area(m_conn, src, dst, m_copyGC, b.x, b.y, b.x, b.y, b.width, b.height);
+    }
+
+    // y is the baseline. Like ImageText, the text cell is painted with bg.
+    void drawText(xcb_drawable_t d, FontId f, const char *text, int x, int y,
+                  uint32_t fg, uint32_t bg) {
+        size_t len = std::min<size_t>(std::strlen(text), 255);
+        if (!m_useRender) {
+            xcb_image_text_8(m_conn, len, d, textGC(f, fg, bg), x, y, text);
+            return;
+        }
+        const FontMetrics &m = m_metrics[f];
+        fillRect(d, x, y - m.ascent, textWidth(f, len), m.height(), bg);
+
+        // Whole string in one CompositeGlyphs8: elements of at most 254
+        // glyphs (255 switches glyph sets), each a 8 byte header padded to 4.
+        uint8_t cmds[2 * 8 + 256 + 4];
+        size_t n = 0;
+        for (size_t i = 0; i < len; i += 254) {
+            size_t count = std::min<size_t>(len - i, 254);
+            int16_t delta[2] = { static_cast<int16_t>(i == 0 ? x : 0),
+                                 static_cast<int16_t>(i == 0 ? y : 0) };
+            cmds[n] = static_cast<uint8_t>(count);
+            std::memset(cmds + n + 1, 0, 3);
+            std::memcpy(cmds + n + 4, delta, sizeof(delta));
+            n += 8;
+            for (size_t j = 0; j < count; j++) {
+                uint8_t c = static_cast<uint8_t>(text[i + j]);
+                cmds[n++] = hasGlyph(c) ? c : '?';
+            }
+            while (n % 4)
+                cmds[n++] = 0;
+        }
+        xcb_render_composite_glyphs_8(m_conn, XCB_RENDER_PICT_OP_OVER, solidFill(fg),
+                                      targetPicture(d), m_a8Format, m_glyphSets[f],
+                                      0, 0, n, cmds);
+    }
+
+    // Call before freeing a pixmap that text was drawn into.
+    void release(xcb_drawable_t d) {
+        for (auto it = m_targets.begin(); it != m_targets.end(); ++it) {
+            if (it->drawable == d) {
+                xcb_render_free_picture(m_conn, it->picture);
+                m_targets.erase(it);
+                return;
+            }
+        }
+    }
+
+private:
+    void unclip() {
+        if (!m_copyClipped)
+            return;
+        uint32_t none = XCB_NONE;
+        xcb_change_gc(m_conn, m_copyGC, XCB_GC_CLIP_MASK, &none);
+        m_copyClipped = false;
+    }
+
+    // Printable Latin-1; everything else is drawn as '?'.
+    static bool hasGlyph(uint8_t c) { return (c >= 32 && c < 127) || c >= 160; }
+
+    bool initGlyphs(xcb_visualid_t rootVisual) {
+        const xcb_query_extension_reply_t *ext = xcb_get_extension_data(m_conn, &xcb_render_id);
+        if (!ext || !ext->present)
+            return false;
+        auto verCookie = xcb_render_query_version(m_conn, 0, 10);
+        auto fmtCookie = xcb_render_query_pict_formats(m_conn);
+        UniqueXCBReply<xcb_render_query_version_reply_t> ver(
+            xcb_render_query_version_reply(m_conn, verCookie, nullptr));
+        UniqueXCBReply<xcb_render_query_pict_formats_reply_t> fmts(
+            xcb_render_query_pict_formats_reply(m_conn, fmtCookie, nullptr));
+        // CreateSolidFill needs RENDER 0.10.
+        if (!ver || !fmts || (ver->major_version == 0 && ver->minor_version < 10))
+            return false;
+
+        m_a8Format = m_rootFormat = XCB_NONE;
+        const xcb_render_pictforminfo_t *info = xcb_render_query_pict_formats_formats(fmts.get());
+        int numFormats = xcb_render_query_pict_formats_formats_length(fmts.get());
+        for (int i = 0; i < numFormats; i++) {
+            const auto &d = info[i].direct;
+            if (info[i].type == XCB_RENDER_PICT_TYPE_DIRECT && info[i].depth == 8 &&
+                d.alpha_mask == 0xFF && !d.red_mask && !d.green_mask && !d.blue_mask)
+                m_a8Format = info[i].id;
+        }
+        for (auto s = xcb_render_query_pict_formats_screens_iterator(fmts.get());
+             s.rem && m_rootFormat == XCB_NONE; xcb_render_pictscreen_next(&s)) {
+            for (auto d = xcb_render_pictscreen_depths_iterator(s.data);
+                 d.rem && m_rootFormat == XCB_NONE; xcb_render_pictdepth_next(&d)) {
+                const xcb_render_pictvisual_t *v = xcb_render_pictdepth_visuals(d.data);
+                int numVisuals = xcb_render_pictdepth_visuals_length(d.data);
+                for (int i = 0; i < numVisuals; i++) {
+                    if (v[i].visual == rootVisual) {
+                        m_rootFormat = v[i].format;
+                        break;
+                    }
+                }
+            }
+        }
+        if (m_a8Format == XCB_NONE || m_rootFormat == XCB_NONE)
+            return false;
+
+        const double sizes[FONT_COUNT] = { DEFAULT_FONT_SIZE, RUNNER_FONT_SIZE };
+        for (int f = 0; f < FONT_COUNT; f++) {
+            if (!loadGlyphSet(static_cast<FontId>(f), sizes[f])) {
+                for (int g = 0; g < f; g++)
+                    xcb_render_free_glyph_set(m_conn, m_glyphSets[g]);
+                std::fill(std::begin(m_glyphSets), std::end(m_glyphSets), XCB_NONE);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Rasterizes every glyph of one font with cairo and uploads them all in a
+    // single AddGlyphs. Advances are forced to one cell width so text layout
+    // (and the runner's per-cell redraw) stays fixed-pitch.
+    bool loadGlyphSet(FontId f, double size) {
+        cairo_surface_t *probe = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+        cairo_t *cr = cairo_create(probe);
+        cairo_select_font_face(cr, TEXT_FONT_FAMILY, CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+        cairo_set_font_size(cr, size);
+        cairo_font_extents_t fe;
+        cairo_font_extents(cr, &fe);
+        bool ok = cairo_status(cr) == CAIRO_STATUS_SUCCESS && fe.max_x_advance > 0;
+        cairo_destroy(cr);
+        cairo_surface_destroy(probe);
+        if (!ok)
+            return false;
+
+        FontMetrics &m = m_metrics[f];
+        m.ascent    = static_cast<int>(std::ceil(fe.ascent));
+        m.descent   = static_cast<int>(std::ceil(fe.descent));
+        m.charWidth = static_cast<int>(std::lround(fe.max_x_advance));
+
+        // One scratch surface, cleared per glyph; overhanging glyphs are clipped to it.
+        const int side = 2 * std::max(m.height(), m.charWidth) + 4;
+        cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_A8, side, side);
+        cr = cairo_create(surface);
+        cairo_font_options_t *options = cairo_font_options_create();
+        cairo_font_options_set_antialias(options, CAIRO_ANTIALIAS_GRAY);
+        cairo_set_font_options(cr, options);
+        cairo_font_options_destroy(options);
+        cairo_select_font_face(cr, TEXT_FONT_FAMILY, CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+        cairo_set_font_size(cr, size);
+        const uint8_t *pixels = cairo_image_surface_get_data(surface);
+        const int stride = cairo_image_surface_get_stride(surface);
+
+        std::vector<uint32_t> ids;
+        std::vector<xcb_render_glyphinfo_t> infos;
+        std::vector<uint8_t> data;
+        for (int c = 0; c < 256; c++) {
+            if (!hasGlyph(static_cast<uint8_t>(c)))
+                continue;
+            // cairo wants UTF-8; Latin-1 maps straight onto U+0000..U+00FF.
+            char utf8[3] = {};
+            if (c < 0x80) {
+                utf8[0] = static_cast<char>(c);
+            } else {
+                utf8[0] = static_cast<char>(0xC0 | (c >> 6));
+                utf8[1] = static_cast<char>(0x80 | (c & 0x3F));
+            }
+            cairo_text_extents_t te;
+            cairo_text_extents(cr, utf8, &te);
+            int x0 = static_cast<int>(std::floor(te.x_bearing));
+            int y0 = static_cast<int>(std::floor(te.y_bearing));
+            int w  = std::clamp(static_cast<int>(std::ceil(te.x_bearing + te.width)) - x0, 1, side);
+            int h  = std::clamp(static_cast<int>(std::ceil(te.y_bearing + te.height)) - y0, 1, side);
+
+            cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+            cairo_paint(cr);
+            cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+            cairo_set_source_rgba(cr, 0, 0, 0, 1);
+            cairo_move_to(cr, -x0, -y0);
+            cairo_show_text(cr, utf8);
+            cairo_surface_flush(surface);
+
+            // AddGlyphs rows are padded to 4 bytes.
+            const int pitch = (w + 3) & ~3;
+            for (int row = 0; row < h; row++) {
+                const uint8_t *src = pixels + row * stride;
+                data.insert(data.end(), src, src + w);
+                data.insert(data.end(), pitch - w, 0);
+            }
+            ids.push_back(c);
+            infos.push_back({ static_cast<uint16_t>(w), static_cast<uint16_t>(h),
+                              static_cast<int16_t>(-x0), static_cast<int16_t>(-y0),
+                              static_cast<int16_t>(m.charWidth), 0 });
+        }
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+
+        m_glyphSets[f] = xcb_generate_id(m_conn);
+        xcb_render_create_glyph_set(m_conn, m_glyphSets[f], m_a8Format);
+        xcb_render_add_glyphs(m_conn, m_glyphSets[f], ids.size(), ids.data(), infos.data(),
+                              data.size(), data.data());
+        return true;
+    }
+
+    void initCoreFonts() {
+        const char *names[FONT_COUNT] = { DEFAULT_FONT, RUNNER_FONT };
+        xcb_query_font_cookie_t cookies[FONT_COUNT];
+        for (int f = 0; f < FONT_COUNT; f++) {
+            m_fonts[f] = openFont(names[f]);
+            cookies[f] = xcb_query_font(m_conn, m_fonts[f]);
+        }
+        for (int f = 0; f < FONT_COUNT; f++) {
+            UniqueXCBReply<xcb_query_font_reply_t> r(xcb_query_font_reply(m_conn, cookies[f], nullptr));
+            if (!r) { // font missing: "fixed" is always there
+                xcb_close_font(m_conn, m_fonts[f]);
+                m_fonts[f] = openFont("fixed");
+                r.reset(xcb_query_font_reply(m_conn, xcb_query_font(m_conn, m_fonts[f]), nullptr));
+            }
+            if (r)
+                m_metrics[f] = { r->font_ascent, r->font_descent, r->max_bounds.character_width };
+        }
+    }
+
+    // Pictures for the pixmaps drawn into, created on first use.
+    xcb_render_picture_t targetPicture(xcb_drawable_t d) {
+        for (const auto &t : m_targets) {
+            if (t.drawable == d)
+                return t.picture;
+        }
+        xcb_render_picture_t pic = xcb_generate_id(m_conn);
+        xcb_render_create_picture(m_conn, pic, d, m_rootFormat, 0, nullptr);
+        m_targets.push_back({ d, pic });
+        return pic;
+    }
+
+    xcb_render_picture_t solidFill(uint32_t color) {
+        for (const auto &s : m_fills) {
+            if (s.color == color)
+                return s.picture;
+        }
+        xcb_render_color_t rc = { static_cast<uint16_t>(((color >> 16) & 0xFF) * 0x101),
+                                  static_cast<uint16_t>(((color >> 8) & 0xFF) * 0x101),
+                                  static_cast<uint16_t>((color & 0xFF) * 0x101), 0xFFFF };
+        xcb_render_picture_t pic = xcb_generate_id(m_conn);
+        xcb_render_create_solid_fill(m_conn, pic, rc);
+        m_fills.push_back({ color, pic });
+        return pic;
+    }
+
+    xcb_font_t openFont(const char *name) {
+        xcb_font_t font = xcb_generate_id(m_conn);
+        xcb_open_font(m_conn, font, std::strlen(name), name);
+        return font;
+    }
+
+    xcb_gcontext_t textGC(FontId f, uint32_t fg, uint32_t bg) {
+        for (const auto &t : m_textGCs) {
+            if (t.font == f && t.fg == fg && t.bg == bg)
+                return t.gc;
+        }
+        xcb_gcontext_t gc = xcb_generate_id(m_conn);
+        uint32_t vals[3] = { fg, bg, m_fonts[f] };
+        xcb_create_gc(m_conn, gc, m_root, XCB_GC_FOREGROUND | XCB_GC_BACKGROUND | XCB_GC_FONT, vals);
+        m_textGCs.push_back({ f, fg, bg, gc });
+        return gc;
+    }
+
+    static constexpr size_t CACHE_CAPACITY = 8; // more than the dialogs use
+
+    struct TextGC {
+        FontId         font;
+        uint32_t       fg;
+        uint32_t       bg;
+        xcb_gcontext_t gc;
+    };
+
+    struct TargetPicture {
+        xcb_drawable_t       drawable;
+        xcb_render_picture_t picture;
+    };
+
+    struct SolidFill {
+        uint32_t             color;
+        xcb_render_picture_t picture;
+    };
+
+    xcb_connection_t   *m_conn = nullptr;
+    xcb_window_t        m_root = XCB_NONE;
+    xcb_font_t          m_fonts[FONT_COUNT]   = {};
+    FontMetrics         m_metrics[FONT_COUNT];
+    std::vector<TextGC> m_textGCs; // a handful: linear search beats hashing
+    bool                    m_useRender  = false; // glyph sets loaded
+    xcb_render_pictformat_t m_a8Format   = XCB_NONE;
+    xcb_render_pictformat_t m_rootFormat = XCB_NONE;
+    xcb_render_glyphset_t   m_glyphSets[FONT_COUNT] = {};
+    std::vector<TargetPicture> m_targets; // one per open popup
+    std::vector<SolidFill>     m_fills;   // one per text colour
+    xcb_gcontext_t      m_fillGC = XCB_NONE;
+    uint32_t            m_fillFg = 0;
+    xcb_gcontext_t      m_copyGC = XCB_NONE;
+    bool                m_copyClipped = false; // copy GC has clip rectangles set
+};
+
 /*******************************************************************************
  * WindowManager (WM) class
  ******************************************************************************/
@@ -179,29 +1588,84 @@ public:
 
 private:
     // Internal helpers
-    bool setupEWMH();
-    void setupAtoms();
+    bool setupAtoms();
     void setupCursor();
     void selectInputOnRoot();
     void grabKeysAndButtons();
     void setupSupportingWMCheck();
+    void setupRefreshRate();
     void resetFocus(); // reset input focus to a valid window
 
-    // Helper to draw text in a window (used for dialogs)
-    void drawText(xcb_window_t win, const char* fontName, const char* text,
-                  int x, int y, uint32_t fgColor, uint32_t bgColor);
+    // Event loop: dispatch one event, flush once per drained batch
+    void processEventBatch(xcb_generic_event_t *ev);
+    void handleSignal(int sig);
+    void dumpStats();
+    void dispatchEvent(xcb_generic_event_t *ev);
+    void setupExtensionEvents();
+    void track(xcb_void_cookie_t ck, uint8_t opcode,
+               ErrorTracker::Callback cb = nullptr);
+
+    // Replies a handler must not wait for: the request's sequence is queued
+    // and collectReplies() picks the replies up, in order, once they have
+    // arrived. Nothing ever blocks inside a batch.
+    enum ReplyKind : uint8_t {
+        REPLY_WM_STATE,     // refresh Client::state
+        REPLY_WM_PROTOCOLS, // refresh Client::protocols
+        REPLY_STRUT_PARTIAL, // refresh Client::strut; _NET_WM_STRUT_PARTIAL wins
+        REPLY_STRUT,         // ... over the legacy _NET_WM_STRUT read right after it
+        REPLY_CYCLE_GRAB,    // the Alt+Tab keyboard grab
+        REPLY_CYCLE_POINTER, // modifiers right after it, to catch an early Alt release
+    };
+    struct PendingReply {
+        unsigned int sequence;
+        ReplyKind    kind;
+        xcb_window_t window;
+    };
+    void expectReply(unsigned int sequence, ReplyKind kind, xcb_window_t w);
+    void collectReplies();
+    void handleReply(const PendingReply &p, void *reply);
+
+    // Dispatch table indexed by response type (sent-event bit stripped).
+    // Core entries are built at compile time; extension events are added
+    // at their runtime base by setupExtensionEvents().
+    using EventThunk = void (*)(WM *wm, xcb_generic_event_t *ev);
+    struct DispatchEntry {
+        const char *name = "unhandled";
+        EventThunk  fn   = nullptr;
+    };
+    static constexpr size_t NUM_RESPONSE_TYPES = 128;
+    using DispatchTable = std::array<DispatchEntry, NUM_RESPONSE_TYPES>;
+
+    template<typename Event, void (WM::*Handler)(Event*)>
+    static void thunk(WM *wm, xcb_generic_event_t *ev) {
+        (wm->*Handler)(reinterpret_cast<Event*>(ev));
+    }
+    static constexpr DispatchTable makeCoreDispatch();
+    static const DispatchTable s_coreDispatch;
+    void flushBatch(size_t batchSize);
+    bool isDragMotion(const xcb_generic_event_t *ev) const;
 
     // Event handlers
     void handleKeyPress(xcb_key_press_event_t *ev);
+    void handleKeyRelease(xcb_key_release_event_t *ev);
     void handleButtonPress(xcb_button_press_event_t *ev);
     void handleMotionNotify(xcb_motion_notify_event_t *ev);
+    void dragTo(int rootX, int rootY);
+    void submitDragGeometry(xcb_window_t w, uint16_t mask, const uint32_t *vals);
+    void applyPendingDrag();
     void handleButtonRelease(xcb_button_release_event_t *ev);
     void handleMapRequest(xcb_map_request_event_t *mr);
     void handleDestroyNotify(xcb_destroy_notify_event_t *dn);
+    void handleMapNotify(xcb_map_notify_event_t *mn);
     void handleUnmapNotify(xcb_unmap_notify_event_t *un);
     void handleConfigureRequest(xcb_configure_request_event_t *cr);
     void handleExpose(xcb_expose_event_t *ev);
     void handleClientMessage(xcb_client_message_event_t *cm);
+    void handleFocusIn(xcb_focus_in_event_t *ev);
+    void handleFocusOut(xcb_focus_out_event_t *ev);
+    void handlePropertyNotify(xcb_property_notify_event_t *ev);
+    void handleError(xcb_generic_error_t *err);
+    void handleScreenChangeNotify(xcb_randr_screen_change_notify_event_t *ev);
 #ifdef FOCUS_FOLLOWS_MOUSE
     void handleEnterNotify(xcb_enter_notify_event_t *ev);
 #endif
@@ -209,12 +1673,24 @@ private:
     // Fullscreen toggle
     void toggleFullscreen(xcb_window_t w);
 
+    // _NET_WM_STATE bookkeeping (see Client::state)
+    struct Client;
+    void setFullscreen(xcb_window_t w, Client &c, bool on);
+    void setClientState(xcb_window_t w, uint32_t bits, bool on);
+    void writeNetWmState(xcb_window_t w, Client &c);
+    uint32_t stateFromAtoms(const xcb_atom_t *atoms, uint32_t len) const;
+
+    // WM_PROTOCOLS bookkeeping (see Client::protocols)
+    uint32_t protocolsFromAtoms(const xcb_atom_t *atoms, uint32_t len) const;
+    bool supportsProtocol(xcb_window_t w, uint32_t proto) const;
+    void sendProtocolMessage(xcb_window_t w, xcb_atom_t protocol);
+
     // Runner, Exit, and Help dialogs / popups
-    void createPopUpWindow(const char* title,
-                           xcb_window_t &winVar,
-                           uint16_t width, uint16_t height,
-                           bool &activeFlag);
-    void destroyPopUpWindow(xcb_window_t &winVar, bool &activeFlag);
+    struct PopUp;
+    void preparePopUp(PopUp &p, const char *title);
+    void createPopUpWindow(PopUp &p, uint16_t width, uint16_t height);
+    void destroyPopUpWindow(PopUp &p);
+    void renderPopUp(PopUp &p);
 
     void createExitConfirmationDialog();
     void destroyExitConfirmationDialog();
@@ -222,7 +1698,8 @@ private:
 
     void createRunnerDialog();
     void destroyRunnerDialog();
-    void redrawRunnerDialog();
+    void updateRunnerText(size_t from, size_t oldSize);
+    void runnerCaretRect(int &x, int &y, int &width, int &height) const;
     void handleRunnerInput(xcb_keysym_t ks);
     void executeCommand(const std::string &cmd);
 
@@ -247,31 +1724,70 @@ private:
         uint16_t start_height = 0;
     } resizeStart;
 
+    // Frame pacing for move/resize: at most one configure per refresh
+    // interval; the newest geometry waits in `vals` until the timer fires.
+    struct DragPacer {
+        int          timer       = -1;
+        double       refreshHz   = DRAG_FALLBACK_REFRESH_HZ;
+        uint64_t     intervalNs  = 1000000000ull / DRAG_FALLBACK_REFRESH_HZ;
+        uint64_t     lastApplyNs = 0;
+        bool         pending     = false;
+        xcb_window_t window      = XCB_NONE;
+        uint16_t     mask        = 0;
+        uint32_t     vals[2]     = {};
+    } m_dragPacer;
+
 private:
     xcb_connection_t       *m_conn   = nullptr;
     xcb_screen_t           *m_screen = nullptr;
     xcb_ewmh_connection_t   m_ewmh;
     xcb_cursor_t            m_cursor = XCB_CURSOR_NONE;
     xcb_key_symbols_t      *m_keysyms= nullptr;
+    EventLoop               m_loop;
+    RenderContext           m_render;
+    ErrorTracker            m_errors;
+    const char             *m_currentHandler = "startup"; // for error attribution
+
+    static constexpr size_t MAX_PENDING_REPLIES = 256;
+    PendingReply            m_replies[MAX_PENDING_REPLIES];
+    size_t                  m_repliesHead  = 0;
+    size_t                  m_repliesCount = 0;
+
+    DispatchTable m_dispatch = s_coreDispatch;
+    std::array<LatencyHistogram, NUM_RESPONSE_TYPES> m_latency;
 
     int m_screenWidth  = 0;
     int m_screenHeight = 0;
 
-    std::vector<xcb_window_t> m_windowList;
-    size_t m_currentWindowIndex = 0;
+    // Authoritative input focus, maintained from focusWindow/resetFocus and
+    // FocusIn/FocusOut so key bindings never have to ask the server.
+    xcb_window_t m_focusedWindow = XCB_NONE;
+
+    // A dialog draws into its off-screen pixmap only when its content
+    // changes; Expose copies the exposed region back to the window.
+    struct PopUp {
+        xcb_window_t window = XCB_NONE;
+        xcb_pixmap_t pixmap = XCB_NONE;
+        uint16_t     width  = 0;
+        uint16_t     height = 0;
+        bool         active = false;
+        DamageRegion damage;         // exposed, not yet repainted
+        std::unique_ptr<Client> record; // made at startup, lent to m_clients while open
+    };
+    static constexpr size_t POPUP_COUNT = 3; // m_runner, m_exitDialog, m_help
 
     // Runner dialog state
-    bool         m_isRunnerActive          = false;
-    xcb_window_t m_runnerWindow            = XCB_NONE;
+    PopUp        m_runner;
     std::string  m_runnerInput;
+    bool             m_runnerKeyPending = false; // edit waiting for the batch flush
+    uint64_t         m_batchStartNs     = 0;     // when the current batch was read
+    LatencyHistogram m_runnerLatency;            // key press to pixels flushed
 
     // Exit confirmation dialog state
-    bool         m_isExitConfirmationActive = false;
-    xcb_window_t m_exitConfirmationWindow   = XCB_NONE;
+    PopUp        m_exitDialog;
 
     // Help popup state (non-modal)
-    bool         m_isHelpActive = false;
-    xcb_window_t m_helpWindow   = XCB_NONE;
+    PopUp        m_help;
 
     // For storing window geometries
     struct WindowGeometry {
@@ -280,23 +1796,138 @@ private:
         uint16_t width;
         uint16_t height;
     };
-    std::map<xcb_window_t, WindowGeometry> m_geometryCache;
-    std::map<xcb_window_t, WindowGeometry> m_originalGeometry;
-
-    // New features: minimized windows.
-    std::vector<xcb_window_t> m_minimizedWindows;
-
-    // Atoms
-    xcb_atom_t WM_PROTOCOLS;
-    xcb_atom_t WM_DELETE_WINDOW;
-    xcb_atom_t NET_WM_STATE;
-    xcb_atom_t NET_WM_STATE_FULLSCREEN;
-    xcb_atom_t _NET_SUPPORTING_WM_CHECK;
+    // One record per managed window (popups included), read in a single
+    // round trip on adoption and kept current from events afterwards.
+    struct Client {
+        xcb_window_t            window         = XCB_NONE;
+        Client                 *prev           = nullptr; // focus order,
+        Client                 *next           = nullptr; // most recent first
+        Client                 *stackBelow     = nullptr; // stacking order,
+        Client                 *stackAbove     = nullptr; // bottom to top
+        uint64_t                stackSerial    = 0;       // higher is further up
+        SpatialGrid<Client>::Hook gridHook;               // position in m_grid
+        // Write-through geometry cache: updated with every configure we send
+        // and confirmed by ConfigureNotify once the server has processed it.
+        WindowGeometry          geom           = {};
+        unsigned int            lastConfigureSeq  = 0;    // sequence of our newest configure
+        bool                    configureInFlight = false;
+        std::string             title;
+        bool                    titleStale     = false;   // refetched on demand
+        xcb_size_hints_t        normalHints    = {};
+        bool                    hasNormalHints = false;
+        std::string             resName;
+        std::string             resClass;
+        xcb_atom_t              windowType     = XCB_NONE;
+        uint32_t                strut[4]       = {};    // left, right, top, bottom
+        uint32_t                protocols      = 0;     // PROTO_* bits
+        uint32_t                state          = 0;     // _NET_WM_STATE bits
+        uint32_t                pendingStateWrites = 0; // our own writes not yet notified
+        unsigned int            stateFetch     = 0;     // newest _NET_WM_STATE read in flight
+        unsigned int            protocolsFetch = 0;     // newest WM_PROTOCOLS read in flight
+        unsigned int            strutFetch     = 0;     // strut read still to be applied
+        std::optional<WindowGeometry> savedGeometry;    // pre-fullscreen geometry
+        bool                    mapped         = false; // from MapNotify/UnmapNotify
+        bool                    mapPending     = false; // map sent, MapNotify not seen yet
+        bool                    minimized      = false; // Alt+M, until Alt+N
+
+        bool focusable() const { return mapped && !minimized; }
+    };
+    WindowTable<Client> m_clients;
+    Client *m_mruHead = nullptr;
+    Client *m_mruTail = nullptr;
+
+    // Alt+Tab walks the MRU list without reordering it; the window it
+    // lands on is promoted once Alt is released.
+    struct FocusCycle {
+        bool         active     = false;
+        bool         grabWanted = false; // sent by flushBatch, not the key handler
+        unsigned int grabSeq    = 0;
+        Client      *cursor     = nullptr;
+    } m_cycle;
+
+    // Our model of the stacking order of managed windows, updated as we
+    // restack and corrected from ConfigureNotify::above_sibling.
+    Client  *m_stackBottom   = nullptr;
+    Client  *m_stackTop      = nullptr;
+    uint64_t m_stackSerial   = 0;
+    bool     m_stackingDirty = false; // _NET_CLIENT_LIST_STACKING needs rewriting
+
+    // Temporary data for the batch being handled; reset in flushBatch().
+    ScratchArena m_scratch;
+
+    // Client rectangles, kept in step with every geometry cache update.
+    SpatialGrid<Client> m_grid;
+
+    // Last pointer position seen in an event, root coordinates.
+    struct PointerPos {
+        int  x     = 0;
+        int  y     = 0;
+        bool known = false;
+    } m_lastPointer;
+
+    // Edges a moved window snaps to: vertical edges (x positions) in m_snapX,
+    // horizontal ones in m_snapY. The screen and work-area edges come first
+    // and stay for the whole drag; window edges follow and are re-gathered
+    // from the grid around each drag step.
+    static constexpr size_t SNAP_FIXED_EDGES = 4;
+    SnapEdges m_snapX;
+    SnapEdges m_snapY;
+    LatencyHistogram m_snapLatency;
+
+    // Batch statistics (events handled per single xcb_flush)
+    struct EventStats {
+        uint64_t batches      = 0;
+        uint64_t events       = 0;
+        uint64_t flushes      = 0;
+        size_t   largestBatch = 0;
+        uint64_t motionCoalesced = 0; // MotionNotify dropped in favour of a newer one
+        uint64_t geomHits   = 0;
+        uint64_t geomMisses = 0;          // had to block on xcb_get_geometry
+        uint64_t geomStale  = 0;          // cache corrected by ConfigureNotify
+        uint64_t dragApplied = 0;         // drag configures sent
+        uint64_t dragSkipped = 0;         // drag steps superseded within a frame
+        uint64_t restacks        = 0;     // STACK_MODE_ABOVE sent
+        uint64_t restacksSkipped = 0;     // window was already on top
+        uint64_t mapsSkipped     = 0;     // window was already mapped
+        uint64_t exposeRepaints   = 0;    // popup repaints (one per Expose series)
+        uint64_t exposesCoalesced = 0;    // Expose events folded into a later repaint
+    } m_stats;
+
+    // Atoms, indexed by AtomId
+    xcb_atom_t m_atoms[ATOM_COUNT] = {};
 
 private:
     xcb_keysym_t getKeysym(xcb_keycode_t code, uint16_t state);
-    void invalidateGeometryCache(xcb_window_t w);
+#ifdef DEBUG_LOGS
+    void verifyTrackedFocus();
+#endif
+    Client &addClient(xcb_window_t w);
+    Client &adoptClient(xcb_window_t w, std::unique_ptr<Client> record);
+    void removeClient(xcb_window_t w);
+    std::unique_ptr<Client> detachClient(xcb_window_t w);
+    void linkClient(Client *c, Client *before);
+    void unlinkClient(Client *c);
+    void promoteClient(Client *c);
+    void restackModel(Client *c, Client *below);
+    void applyStackRequest(Client *c, const xcb_configure_request_event_t *cr);
+    void unlinkStack(Client *c);
+    void raiseClient(Client &c);
+    void mapClient(Client &c);
+    void publishStacking();
+    void updateGrid(Client &c);
+    void resizeGrid();
+    Client *clientAt(int x, int y);
+    GridRect workArea() const;
+    void buildSnapEdges();
+    void collectSnapEdges(const GridRect &r, const Client *dragged);
+    template<typename F> void forEachOverlapping(const GridRect &r, const Client *skip, F &&f);
+    template<typename F> void forEachAdjacent(const GridRect &r, int tolerance, const Client *skip, F &&f);
+    void endFocusCycle();
+    void sendCycleGrab();
+    const std::string &clientTitle(Client &c);
     WindowGeometry getWindowGeometry(xcb_window_t w);
+    void configureWindow(xcb_window_t w, uint16_t mask, const uint32_t *vals);
+    void handleConfigureNotify(xcb_configure_notify_event_t *ev);
     std::optional<xcb_screen_t*> setupScreen(int scrNum);
     Logger &m_logger;
 };
@@ -331,15 +1962,24 @@ bool WM::initialize()
 
     m_screenWidth  = m_screen->width_in_pixels;
     m_screenHeight = m_screen->height_in_pixels;
+    m_grid.resize(m_screenWidth, m_screenHeight);
+    xcb_prefetch_extension_data(m_conn, &xcb_randr_id);
 
-    if (!setupEWMH()) {
+    if (!setupAtoms()) {
         m_logger.log("Failed to initialize EWMH.");
         return false;
     }
-    setupAtoms();
     setupCursor();
+    m_render.init(m_conn, m_screen);
     selectInputOnRoot();
 
+    m_runnerInput.reserve(RUNNER_MAX_INPUT);
+    // Dialogs open from key handlers, so everything they add is made now.
+    preparePopUp(m_exitDialog, "Confirm Exit");
+    preparePopUp(m_runner, "Run Program");
+    preparePopUp(m_help, "Key Bindings");
+    m_clients.reserve(POPUP_COUNT);
+    m_grid.reserve(POPUP_COUNT);
     m_keysyms = xcb_key_symbols_alloc(m_conn);
     if (!m_keysyms) {
         m_logger.log("Failed to allocate keysyms.");
@@ -348,43 +1988,41 @@ bool WM::initialize()
 
     grabKeysAndButtons();
     setupSupportingWMCheck();
+    setupRefreshRate();
+    setupExtensionEvents();
 
     xcb_flush(m_conn);
     return true;
 }
 
-bool WM::setupEWMH()
+bool WM::setupAtoms()
 {
+    // Queue the EWMH helper's interns and our own table back to back, then
+    // collect: startup pays one round trip however many atoms we add.
     std::memset(&m_ewmh, 0, sizeof(m_ewmh));
-    auto *cookies = xcb_ewmh_init_atoms(m_conn, &m_ewmh);
-    if (!xcb_ewmh_init_atoms_replies(&m_ewmh, cookies, nullptr)) {
-        return false;
+    xcb_intern_atom_cookie_t *ewmhCookies = xcb_ewmh_init_atoms(m_conn, &m_ewmh);
+    xcb_intern_atom_cookie_t cookies[ATOM_COUNT];
+    for (size_t i = 0; i < ATOM_COUNT; i++) {
+        const char *name = ATOM_TABLE[i].name;
+        cookies[i] = xcb_intern_atom(m_conn, 0, std::strlen(name), name);
     }
-    return true;
-}
 
-void WM::setupAtoms()
-{
-    auto get_atom = [this](const char* name) -> xcb_atom_t {
-        xcb_intern_atom_cookie_t c = xcb_intern_atom(m_conn, 0, std::strlen(name), name);
-        UniqueXCBReply<xcb_intern_atom_reply_t> r(xcb_intern_atom_reply(m_conn, c, nullptr));
-        return r ? r->atom : XCB_NONE;
-    };
-
-    WM_PROTOCOLS             = get_atom("WM_PROTOCOLS");
-    WM_DELETE_WINDOW         = get_atom("WM_DELETE_WINDOW");
-    NET_WM_STATE             = get_atom("_NET_WM_STATE");
-    NET_WM_STATE_FULLSCREEN  = get_atom("_NET_WM_STATE_FULLSCREEN");
-    _NET_SUPPORTING_WM_CHECK = get_atom("_NET_SUPPORTING_WM_CHECK");
+    bool ewmhOk = xcb_ewmh_init_atoms_replies(&m_ewmh, ewmhCookies, nullptr);
+    xcb_atom_t supported[ATOM_COUNT];
+    uint32_t numSupported = 0;
+    for (size_t i = 0; i < ATOM_COUNT; i++) {
+        UniqueXCBReply<xcb_intern_atom_reply_t> r(xcb_intern_atom_reply(m_conn, cookies[i], nullptr));
+        m_atoms[i] = r ? r->atom : XCB_NONE;
+        if (ATOM_TABLE[i].supported && m_atoms[i] != XCB_NONE)
+            supported[numSupported++] = m_atoms[i];
+    }
+    if (!ewmhOk)
+        return false;
 
-    xcb_atom_t NET_SUPPORTED = get_atom("_NET_SUPPORTED");
-    std::vector<xcb_atom_t> supported = {
-        NET_WM_STATE,
-        NET_WM_STATE_FULLSCREEN
-    };
     xcb_change_property(m_conn, XCB_PROP_MODE_REPLACE, m_screen->root,
-                        NET_SUPPORTED, XCB_ATOM_ATOM, 32,
-                        supported.size(), supported.data());
+                        m_atoms[ATOM_NET_SUPPORTED], XCB_ATOM_ATOM, 32,
+                        numSupported, supported);
+    return true;
 }
 
 void WM::setupCursor()
@@ -411,18 +2049,18 @@ void WM::selectInputOnRoot()
                   | XCB_EVENT_MASK_PROPERTY_CHANGE
                   | XCB_EVENT_MASK_BUTTON_PRESS
                   | XCB_EVENT_MASK_BUTTON_RELEASE
-                  | XCB_EVENT_MASK_POINTER_MOTION
 #ifdef FOCUS_FOLLOWS_MOUSE
                   | XCB_EVENT_MASK_ENTER_WINDOW
 #endif
                   | XCB_EVENT_MASK_EXPOSURE;
 
-    xcb_void_cookie_t ck = xcb_change_window_attributes_checked(m_conn, m_screen->root, mask, &val);
-    xcb_generic_error_t* err = xcb_request_check(m_conn, ck);
-    if (err) {
-        m_logger.log("Another WM is probably running; cannot redirect the root window.");
-        free(err);
-    }
+    // Unchecked: a failure is reported asynchronously by the event loop.
+    track(xcb_change_window_attributes(m_conn, m_screen->root, mask, &val),
+          XCB_CHANGE_WINDOW_ATTRIBUTES,
+          [](void *ctx, const xcb_generic_error_t *) {
+              static_cast<WM*>(ctx)->m_logger.log(
+                  "Another WM is probably running; cannot redirect the root window.");
+          });
 }
 
 void WM::grabKeysAndButtons()
@@ -449,11 +2087,11 @@ void WM::grabKeysAndButtons()
             free(kc);
         }
         xcb_grab_button(m_conn, 1, m_screen->root,
-            XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION,
+            XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE,
             XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
             XCB_NONE, XCB_NONE, 1, mod);
         xcb_grab_button(m_conn, 1, m_screen->root,
-            XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION,
+            XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE,
             XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
             XCB_NONE, XCB_NONE, 3, mod);
     }
@@ -468,77 +2106,444 @@ void WM::setupSupportingWMCheck()
                       XCB_WINDOW_CLASS_INPUT_OUTPUT,
                       m_screen->root_visual, 0, nullptr);
     xcb_change_property(m_conn, XCB_PROP_MODE_REPLACE, wmCheckWin,
-                        _NET_SUPPORTING_WM_CHECK, XCB_ATOM_WINDOW, 32, 1, &wmCheckWin);
+                        m_atoms[ATOM_NET_SUPPORTING_WM_CHECK], XCB_ATOM_WINDOW, 32, 1, &wmCheckWin);
     xcb_change_property(m_conn, XCB_PROP_MODE_REPLACE, m_screen->root,
-                        _NET_SUPPORTING_WM_CHECK, XCB_ATOM_WINDOW, 32, 1, &wmCheckWin);
+                        m_atoms[ATOM_NET_SUPPORTING_WM_CHECK], XCB_ATOM_WINDOW, 32, 1, &wmCheckWin);
     const char* wmName = "EnhancedMinimalWM";
     xcb_change_property(m_conn, XCB_PROP_MODE_REPLACE, wmCheckWin,
-                        m_ewmh._NET_WM_NAME, XCB_ATOM_STRING, 8,
+                        m_atoms[ATOM_NET_WM_NAME], XCB_ATOM_STRING, 8,
                         std::strlen(wmName), wmName);
     xcb_map_window(m_conn, wmCheckWin);
     xcb_flush(m_conn);
 }
 
+// Drag pacing follows the fastest active CRTC's mode refresh rate.
+void WM::setupRefreshRate()
+{
+    double hz = 0;
+    const xcb_query_extension_reply_t *ext = xcb_get_extension_data(m_conn, &xcb_randr_id);
+    if (ext && ext->present) {
+        auto verCk = xcb_randr_query_version(m_conn, 1, 3);
+        auto resCk = xcb_randr_get_screen_resources_current(m_conn, m_screen->root);
+        UniqueXCBReply<xcb_randr_query_version_reply_t> ver(
+            xcb_randr_query_version_reply(m_conn, verCk, nullptr)
+        );
+        UniqueXCBReply<xcb_randr_get_screen_resources_current_reply_t> res(
+            xcb_randr_get_screen_resources_current_reply(m_conn, resCk, nullptr)
+        );
+        if (res) {
+            const xcb_randr_crtc_t *crtcs = xcb_randr_get_screen_resources_current_crtcs(res.get());
+            int numCrtcs = xcb_randr_get_screen_resources_current_crtcs_length(res.get());
+            const xcb_randr_mode_info_t *modes = xcb_randr_get_screen_resources_current_modes(res.get());
+            int numModes = xcb_randr_get_screen_resources_current_modes_length(res.get());
+            std::vector<xcb_randr_get_crtc_info_cookie_t> cookies(numCrtcs);
+            for (int i = 0; i < numCrtcs; i++)
+                cookies[i] = xcb_randr_get_crtc_info(m_conn, crtcs[i], res->config_timestamp);
+            for (int i = 0; i < numCrtcs; i++) {
+                UniqueXCBReply<xcb_randr_get_crtc_info_reply_t> crtc(
+                    xcb_randr_get_crtc_info_reply(m_conn, cookies[i], nullptr)
+                );
+                if (!crtc || crtc->mode == XCB_NONE)
+                    continue;
+                for (int m = 0; m < numModes; m++) {
+                    const auto &mi = modes[m];
+                    if (mi.id != crtc->mode || !mi.htotal || !mi.vtotal)
+                        continue;
+                    double vtotal = mi.vtotal;
+                    if (mi.mode_flags & XCB_RANDR_MODE_FLAG_DOUBLE_SCAN) vtotal *= 2;
+                    if (mi.mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE)   vtotal /= 2;
+                    hz = std::max(hz, mi.dot_clock / (mi.htotal * vtotal));
+                }
+            }
+        }
+    }
+    if (hz < 1)
+        hz = DRAG_FALLBACK_REFRESH_HZ;
+    m_dragPacer.refreshHz  = hz;
+    m_dragPacer.intervalNs = static_cast<uint64_t>(1e9 / hz);
+    m_logger.log("Drag pacing at ", hz, " Hz");
+}
+
 void WM::runEventLoop()
 {
-    xcb_flush(m_conn);
-    while (true) {
-        xcb_generic_event_t *ev = xcb_wait_for_event(m_conn);
-        if (!ev) break; // error or connection closed
-        uint8_t rt = ev->response_type & ~0x80;
-        switch (rt) {
-            case XCB_KEY_PRESS:
-                handleKeyPress(reinterpret_cast<xcb_key_press_event_t*>(ev));
-                break;
-            case XCB_BUTTON_PRESS:
-                handleButtonPress(reinterpret_cast<xcb_button_press_event_t*>(ev));
-                break;
-            case XCB_MOTION_NOTIFY:
-                handleMotionNotify(reinterpret_cast<xcb_motion_notify_event_t*>(ev));
-                break;
-            case XCB_BUTTON_RELEASE:
-                handleButtonRelease(reinterpret_cast<xcb_button_release_event_t*>(ev));
-                break;
-            case XCB_MAP_REQUEST:
-                handleMapRequest(reinterpret_cast<xcb_map_request_event_t*>(ev));
-                break;
-            case XCB_DESTROY_NOTIFY:
-                handleDestroyNotify(reinterpret_cast<xcb_destroy_notify_event_t*>(ev));
-                break;
-            case XCB_UNMAP_NOTIFY:
-                handleUnmapNotify(reinterpret_cast<xcb_unmap_notify_event_t*>(ev));
-                break;
-            case XCB_CONFIGURE_REQUEST:
-                handleConfigureRequest(reinterpret_cast<xcb_configure_request_event_t*>(ev));
-                break;
-            case XCB_EXPOSE:
-                handleExpose(reinterpret_cast<xcb_expose_event_t*>(ev));
-                break;
-            case XCB_CLIENT_MESSAGE:
-                handleClientMessage(reinterpret_cast<xcb_client_message_event_t*>(ev));
-                break;
+    if (!m_loop.init()) {
+        m_logger.log("Failed to create epoll instance.");
+        return;
+    }
+    m_loop.addFd(xcb_get_file_descriptor(m_conn), EPOLLIN, [this](uint32_t) {
+        m_currentHandler = "eventLoop";
+        if (xcb_generic_event_t *ev = xcb_poll_for_event(m_conn))
+            processEventBatch(ev);
+    });
+    if (!m_loop.addSignals(LOOP_SIGNALS, [this](int sig) {
+            m_currentHandler = "handleSignal";
+            handleSignal(sig);
+        }))
+        m_logger.log("Failed to create signalfd; signals are not handled.");
+#ifdef PACED_DRAG
+    m_dragPacer.timer = m_loop.addTimer([this] {
+        m_currentHandler = "dragTimer";
+        applyPendingDrag();
+    });
+#endif
+
+    while (m_loop.running()) {
+        // XCB may already hold events it read while waiting for a reply;
+        // the socket won't signal those, so drain them before sleeping.
+        if (xcb_generic_event_t *ev = xcb_poll_for_queued_event(m_conn))
+            processEventBatch(ev);
+        // After every batch, and after wakeups that only brought replies;
+        // handlers may queue requests, so this goes before the flush.
+        collectReplies();
+        xcb_flush(m_conn); // requests queued by timer/signal callbacks
+        if (xcb_connection_has_error(m_conn))
+            break; // connection closed
+        if (!m_loop.runOnce())
+            break;
+    }
+}
+
+void WM::processEventBatch(xcb_generic_event_t *ev)
+{
+    // Drain everything XCB has already read; handlers only queue
+    // requests, and the whole batch goes out with a single flush.
+    size_t batchSize = 0;
+    xcb_generic_event_t *next = nullptr;
+    m_batchStartNs = monotonicNs();
+    do {
+        // During a drag only the newest queued motion matters: collapse
+        // consecutive MotionNotify for the same drag into the last one.
+        if (isDragMotion(ev)) {
+            auto *cur = reinterpret_cast<xcb_motion_notify_event_t*>(ev);
+            while ((next = xcb_poll_for_queued_event(m_conn)) && isDragMotion(next)) {
+                auto *nm = reinterpret_cast<xcb_motion_notify_event_t*>(next);
+                if (nm->event != cur->event || nm->state != cur->state)
+                    break;
+                free(ev);
+                ev  = next;
+                cur = nm;
+                next = nullptr;
+                m_stats.motionCoalesced++;
+            }
+        }
+        dispatchEvent(ev);
+        free(ev);
+        batchSize++;
+        ev   = next ? next : xcb_poll_for_queued_event(m_conn);
+        next = nullptr;
+    } while (ev);
+    flushBatch(batchSize);
+}
+
+void WM::handleSignal(int sig)
+{
+    switch (sig) {
+        case SIGCHLD:
+            while (waitpid(-1, nullptr, WNOHANG) > 0) {}
+            break;
+        case SIGTERM:
+            m_logger.log("SIGTERM received, shutting down.");
+            m_loop.stop();
+            break;
+        case SIGUSR1:
+            dumpStats();
+            break;
+    }
+}
+
+void WM::dumpStats()
+{
+    m_logger.report("LWM stats: " + std::to_string(m_stats.events) + " events in "
+                    + std::to_string(m_stats.batches) + " batches ("
+                    + std::to_string(m_stats.flushes) + " flushes, largest batch "
+                    + std::to_string(m_stats.largestBatch) + ")");
+    m_logger.report("  motion coalesced: " + std::to_string(m_stats.motionCoalesced));
+    m_logger.report("  geometry cache: " + std::to_string(m_stats.geomHits) + " hits, "
+                    + std::to_string(m_stats.geomMisses) + " misses, "
+                    + std::to_string(m_stats.geomStale) + " stale corrections");
+    m_logger.report("  drag updates @ " + std::to_string(m_dragPacer.refreshHz) + " Hz: "
+                    + std::to_string(m_stats.dragApplied) + " applied, "
+                    + std::to_string(m_stats.dragSkipped) + " skipped");
+    if (m_snapLatency.samples)
+        m_logger.report("  snap search: " + std::to_string(m_snapX.size() + m_snapY.size())
+                        + " edges at last drag step, mean "
+                        + std::to_string(m_snapLatency.totalNs / m_snapLatency.samples) + " ns, max "
+                        + std::to_string(m_snapLatency.maxNs) + " ns per motion");
+    if (m_runnerLatency.samples)
+        m_logger.report("  runner key to flush: " + std::to_string(m_runnerLatency.samples)
+                        + " keys, mean " + std::to_string(m_runnerLatency.totalNs / m_runnerLatency.samples)
+                        + " ns, max " + std::to_string(m_runnerLatency.maxNs) + " ns");
+    m_logger.report("  popup exposes: " + std::to_string(m_stats.exposeRepaints) + " repaints, "
+                    + std::to_string(m_stats.exposesCoalesced) + " avoided by coalescing");
+    m_logger.report("  stacking: " + std::to_string(m_stats.restacks) + " restacks, "
+                    + std::to_string(m_stats.restacksSkipped) + " skipped, "
+                    + std::to_string(m_stats.mapsSkipped) + " maps skipped");
+    m_errors.report(m_logger);
+
+    m_logger.report("  handler latency (log2 ns buckets):");
+    for (size_t rt = 0; rt < NUM_RESPONSE_TYPES; rt++) {
+        const LatencyHistogram &h = m_latency[rt];
+        if (!h.samples)
+            continue;
+        std::string line = "    " + std::string(m_dispatch[rt].name) + ": "
+                         + std::to_string(h.samples) + " events, mean "
+                         + std::to_string(h.totalNs / h.samples) + " ns, max "
+                         + std::to_string(h.maxNs) + " ns |";
+        for (int b = 0; b < LatencyHistogram::BUCKETS; b++) {
+            if (h.counts[b])
+                line += " <" + std::to_string(2ull << b) + ":" + std::to_string(h.counts[b]);
+        }
+        m_logger.report(line);
+    }
+}
+
+constexpr WM::DispatchTable WM::makeCoreDispatch()
+{
+    DispatchTable t = {};
+    t[0]                     = { "handleError",            &thunk<xcb_generic_error_t,           &WM::handleError> };
+    t[XCB_KEY_PRESS]         = { "handleKeyPress",         &thunk<xcb_key_press_event_t,         &WM::handleKeyPress> };
+    t[XCB_KEY_RELEASE]       = { "handleKeyRelease",       &thunk<xcb_key_release_event_t,       &WM::handleKeyRelease> };
+    t[XCB_BUTTON_PRESS]      = { "handleButtonPress",      &thunk<xcb_button_press_event_t,      &WM::handleButtonPress> };
+    t[XCB_BUTTON_RELEASE]    = { "handleButtonRelease",    &thunk<xcb_button_release_event_t,    &WM::handleButtonRelease> };
+    t[XCB_MOTION_NOTIFY]     = { "handleMotionNotify",     &thunk<xcb_motion_notify_event_t,     &WM::handleMotionNotify> };
 #ifdef FOCUS_FOLLOWS_MOUSE
-            case XCB_ENTER_NOTIFY:
-                handleEnterNotify(reinterpret_cast<xcb_enter_notify_event_t*>(ev));
-                break;
+    t[XCB_ENTER_NOTIFY]      = { "handleEnterNotify",      &thunk<xcb_enter_notify_event_t,      &WM::handleEnterNotify> };
 #endif
-            default:
-#ifndef DEBUG_LOGS
-                (void)rt;
-#else
-                m_logger.log("Unhandled event type: " + std::to_string(rt));
+    t[XCB_FOCUS_IN]          = { "handleFocusIn",          &thunk<xcb_focus_in_event_t,          &WM::handleFocusIn> };
+    t[XCB_FOCUS_OUT]         = { "handleFocusOut",         &thunk<xcb_focus_out_event_t,         &WM::handleFocusOut> };
+    t[XCB_EXPOSE]            = { "handleExpose",           &thunk<xcb_expose_event_t,            &WM::handleExpose> };
+    t[XCB_DESTROY_NOTIFY]    = { "handleDestroyNotify",    &thunk<xcb_destroy_notify_event_t,    &WM::handleDestroyNotify> };
+    t[XCB_UNMAP_NOTIFY]      = { "handleUnmapNotify",      &thunk<xcb_unmap_notify_event_t,      &WM::handleUnmapNotify> };
+    t[XCB_MAP_NOTIFY]        = { "handleMapNotify",        &thunk<xcb_map_notify_event_t,        &WM::handleMapNotify> };
+    t[XCB_MAP_REQUEST]       = { "handleMapRequest",       &thunk<xcb_map_request_event_t,       &WM::handleMapRequest> };
+    t[XCB_CONFIGURE_NOTIFY]  = { "handleConfigureNotify",  &thunk<xcb_configure_notify_event_t,  &WM::handleConfigureNotify> };
+    t[XCB_CONFIGURE_REQUEST] = { "handleConfigureRequest", &thunk<xcb_configure_request_event_t, &WM::handleConfigureRequest> };
+    t[XCB_PROPERTY_NOTIFY]   = { "handlePropertyNotify",   &thunk<xcb_property_notify_event_t,   &WM::handlePropertyNotify> };
+    t[XCB_CLIENT_MESSAGE]    = { "handleClientMessage",    &thunk<xcb_client_message_event_t,    &WM::handleClientMessage> };
+    return t;
+}
+
+const WM::DispatchTable WM::s_coreDispatch = WM::makeCoreDispatch();
+
+void WM::dispatchEvent(xcb_generic_event_t *ev)
+{
+    uint8_t rt = ev->response_type & ~0x80;
+    const DispatchEntry &entry = m_dispatch[rt];
+    m_currentHandler = entry.name;
+    m_errors.retire(ev->full_sequence);
+    if (!entry.fn) {
+#ifdef DEBUG_LOGS
+        m_logger.log("Unhandled event type: ", rt);
 #endif
-                break;
+        return;
+    }
+    uint64_t start = monotonicNs();
+#ifdef ALLOC_CHECK
+    uint64_t allocsBefore = t_allocCount;
+#endif
+    entry.fn(this, ev);
+    m_latency[rt].record(monotonicNs() - start);
+#ifdef ALLOC_CHECK
+    uint64_t allocs = t_allocCount - allocsBefore;
+    bool mustNotAllocate = rt == XCB_KEY_PRESS || rt == XCB_KEY_RELEASE ||
+                           rt == XCB_MOTION_NOTIFY || rt == XCB_ENTER_NOTIFY ||
+                           rt == XCB_FOCUS_IN || rt == XCB_FOCUS_OUT;
+    if (allocs && mustNotAllocate) {
+        std::fprintf(stderr, "lwm: %s made %llu heap allocations\n",
+                     entry.name, static_cast<unsigned long long>(allocs));
+        std::abort();
+    }
+#endif
+}
+
+void WM::setupExtensionEvents()
+{
+    const xcb_query_extension_reply_t *randr = xcb_get_extension_data(m_conn, &xcb_randr_id);
+    if (randr && randr->present) {
+        m_dispatch[randr->first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY] = {
+            "handleScreenChangeNotify",
+            &thunk<xcb_randr_screen_change_notify_event_t, &WM::handleScreenChangeNotify>
+        };
+        xcb_randr_select_input(m_conn, m_screen->root, XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE);
+    }
+}
+
+void WM::handleError(xcb_generic_error_t *err)
+{
+    m_errors.onError(err);
+#ifdef DEBUG_LOGS
+    m_logger.log("X error ", err->error_code, " for opcode ", err->major_code,
+                 ", resource ", err->resource_id);
+#endif
+}
+
+void WM::handleScreenChangeNotify(xcb_randr_screen_change_notify_event_t *ev)
+{
+    bool rotated = ev->rotation & (XCB_RANDR_ROTATION_ROTATE_90 | XCB_RANDR_ROTATION_ROTATE_270);
+    m_screenWidth  = rotated ? ev->height : ev->width;
+    m_screenHeight = rotated ? ev->width  : ev->height;
+    resizeGrid();
+    setupRefreshRate();
+}
+
+void WM::track(xcb_void_cookie_t ck, uint8_t opcode, ErrorTracker::Callback cb)
+{
+    m_errors.track(ck.sequence, opcode, m_currentHandler, cb, this);
+}
+
+bool WM::isDragMotion(const xcb_generic_event_t *ev) const
+{
+    if ((ev->response_type & ~0x80) != XCB_MOTION_NOTIFY)
+        return false;
+    return moveStart.window != XCB_NONE || resizeStart.window != XCB_NONE;
+}
+
+void WM::expectReply(unsigned int sequence, ReplyKind kind, xcb_window_t w)
+{
+    if (m_repliesCount == MAX_PENDING_REPLIES) {
+        // Queue full: wait for the oldest reply rather than drop it.
+        const PendingReply p = m_replies[m_repliesHead];
+        m_repliesHead = (m_repliesHead + 1) % MAX_PENDING_REPLIES;
+        m_repliesCount--;
+        xcb_generic_error_t *err = nullptr;
+        void *reply = xcb_wait_for_reply(m_conn, p.sequence, &err);
+        free(err);
+        handleReply(p, reply);
+        free(reply);
+    }
+    m_replies[(m_repliesHead + m_repliesCount) % MAX_PENDING_REPLIES] = { sequence, kind, w };
+    m_repliesCount++;
+}
+
+void WM::collectReplies()
+{
+    while (m_repliesCount > 0) {
+        const PendingReply p = m_replies[m_repliesHead];
+        void *reply = nullptr;
+        xcb_generic_error_t *err = nullptr;
+        if (!xcb_poll_for_reply(m_conn, p.sequence, &reply, &err))
+            return; // not here yet; later ones can't be either
+        m_repliesHead = (m_repliesHead + 1) % MAX_PENDING_REPLIES;
+        m_repliesCount--;
+        free(err); // e.g. BadWindow: the window is gone, reply is null
+        handleReply(p, reply);
+        free(reply);
+    }
+}
+
+// Values of a 32-bit property of the given type, or nullptr.
+static const uint32_t *propertyValues32(const xcb_get_property_reply_t *r, xcb_atom_t type,
+                                        uint32_t &len)
+{
+    len = 0;
+    if (!r || r->type != type || r->format != 32)
+        return nullptr;
+    len = xcb_get_property_value_length(r) / 4;
+    return static_cast<const uint32_t*>(xcb_get_property_value(r));
+}
+
+// reply is null if the request failed. Only the newest read of a property
+// is applied; anything older was superseded by a later notify or write.
+void WM::handleReply(const PendingReply &p, void *reply)
+{
+    Client *c = m_clients.find(p.window);
+    auto *prop = static_cast<const xcb_get_property_reply_t*>(reply);
+    uint32_t len;
+    switch (p.kind) {
+        case REPLY_WM_STATE: {
+            if (!c || c->stateFetch != p.sequence)
+                return;
+            c->stateFetch = 0;
+            const uint32_t *atoms = propertyValues32(prop, XCB_ATOM_ATOM, len);
+            c->state = atoms ? stateFromAtoms(atoms, len) : 0;
+            break;
+        }
+        case REPLY_WM_PROTOCOLS: {
+            if (!c || c->protocolsFetch != p.sequence)
+                return;
+            c->protocolsFetch = 0;
+            const uint32_t *atoms = propertyValues32(prop, XCB_ATOM_ATOM, len);
+            c->protocols = atoms ? protocolsFromAtoms(atoms, len) : 0;
+            break;
+        }
+        case REPLY_STRUT_PARTIAL:
+        case REPLY_STRUT: {
+            if (!c || c->strutFetch != p.sequence)
+                return;
+            // The first four values are left, right, top, bottom in both.
+            const uint32_t *s = propertyValues32(prop, XCB_ATOM_CARDINAL, len);
+            if (s && len >= 4) {
+                std::copy(s, s + 4, c->strut);
+                c->strutFetch = 0;
+            } else if (p.kind == REPLY_STRUT_PARTIAL) {
+                c->strutFetch = p.sequence + 1; // the legacy read sent right after
+            } else {
+                std::fill(c->strut, c->strut + 4, 0);
+                c->strutFetch = 0;
+            }
+            break;
+        }
+        case REPLY_CYCLE_GRAB: {
+            if (!m_cycle.active || m_cycle.grabSeq != p.sequence)
+                return;
+            // Someone else holds the keyboard, so the Alt release that ends
+            // the cycle never comes: settle on the window we switched to.
+            auto *g = static_cast<const xcb_grab_keyboard_reply_t*>(reply);
+            if (!g || g->status != XCB_GRAB_STATUS_SUCCESS) {
+                m_logger.log("Alt+Tab: keyboard grab failed, switching without a cycle.");
+                endFocusCycle();
+            }
+            break;
+        }
+        case REPLY_CYCLE_POINTER: {
+            if (!m_cycle.active || m_cycle.grabSeq + 1 != p.sequence)
+                return;
+            // Alt went up before the grab took effect; its release went elsewhere.
+            auto *q = static_cast<const xcb_query_pointer_reply_t*>(reply);
+            if (!q || !(q->mask & XCB_MOD_MASK_1))
+                endFocusCycle();
+            break;
         }
-        free(ev);
     }
 }
 
+void WM::flushBatch(size_t batchSize)
+{
+    if (m_stackingDirty)
+        publishStacking();
+    if (m_cycle.grabWanted)
+        sendCycleGrab();
+    xcb_flush(m_conn);
+    m_scratch.reset();
+    if (m_runnerKeyPending) {
+        m_runnerLatency.record(monotonicNs() - m_batchStartNs);
+        m_runnerKeyPending = false;
+    }
+    m_stats.batches++;
+    m_stats.flushes++;
+    m_stats.events += batchSize;
+    m_stats.largestBatch = std::max(m_stats.largestBatch, batchSize);
+#ifdef DEBUG_LOGS
+    if (batchSize > 1)
+        m_logger.log("Batch: ", batchSize, " events, 1 flush (total ",
+                     m_stats.events, " events / ", m_stats.flushes, " flushes, ",
+                     m_stats.motionCoalesced, " motions coalesced, geometry cache ",
+                     m_stats.geomHits, " hits / ", m_stats.geomMisses, " misses / ",
+                     m_stats.geomStale, " stale)");
+#endif
+}
+
+// Runs after SIGTERM or a lost connection: release our own resources and
+// leave client windows alone, so a WM replacement or `pkill lwm` does not
+// take the session's applications with it.
 void WM::cleanup()
 {
-    for (auto w : m_windowList) {
-        xcb_destroy_window(m_conn, w);
+    // Minimized windows would otherwise stay unmapped and unreachable.
+    for (Client *c = m_mruHead; c; c = c->next) {
+        if (c->minimized)
+            xcb_map_window(m_conn, c->window);
     }
+    m_render.cleanup();
     xcb_flush(m_conn);
     if (m_cursor != XCB_CURSOR_NONE) {
         xcb_free_cursor(m_conn, m_cursor);
@@ -557,40 +2562,83 @@ void WM::cleanup()
 void WM::focusWindow(xcb_window_t w)
 {
     if (w == XCB_NONE) return;
-    uint32_t vals[] = { XCB_STACK_MODE_ABOVE };
-    xcb_configure_window(m_conn, w, XCB_CONFIG_WINDOW_STACK_MODE, vals);
-    xcb_map_window(m_conn, w);
-    xcb_set_input_focus(m_conn, XCB_INPUT_FOCUS_POINTER_ROOT, w, XCB_CURRENT_TIME);
-    xcb_flush(m_conn);
+    Client *c = m_clients.find(w);
+    if (c) {
+        raiseClient(*c);
+        mapClient(*c);
+    } else {
+        uint32_t vals[] = { XCB_STACK_MODE_ABOVE };
+        xcb_configure_window(m_conn, w, XCB_CONFIG_WINDOW_STACK_MODE, vals);
+        track(xcb_map_window(m_conn, w), XCB_MAP_WINDOW);
+    }
+    track(xcb_set_input_focus(m_conn, XCB_INPUT_FOCUS_POINTER_ROOT, w, XCB_CURRENT_TIME),
+          XCB_SET_INPUT_FOCUS);
+    if (supportsProtocol(w, PROTO_TAKE_FOCUS))
+        sendProtocolMessage(w, m_atoms[ATOM_WM_TAKE_FOCUS]);
+    m_focusedWindow = w;
+    if (c)
+        promoteClient(c);
+#ifdef DEBUG_LOGS
+    if (c)
+        m_logger.log("Focus: ", clientTitle(*c));
+#endif
 }
 
 void WM::focusNextWindow()
 {
-    if (m_windowList.empty()) return;
-    size_t sz = m_windowList.size();
-    for (size_t i = 0; i < sz; i++) {
-        m_currentWindowIndex = (m_currentWindowIndex + 1) % sz;
-        xcb_window_t w = m_windowList[m_currentWindowIndex];
-        auto c = xcb_get_window_attributes(m_conn, w);
-        UniqueXCBReply<xcb_get_window_attributes_reply_t> ar(
-            xcb_get_window_attributes_reply(m_conn, c, nullptr)
-        );
-        if (ar && ar->map_state == XCB_MAP_STATE_VIEWABLE) {
-            focusWindow(w);
+    Client *from = m_cycle.cursor;
+    if (!m_cycle.active) {
+        from = m_clients.find(m_focusedWindow);
+        // Hold the keyboard so the Alt release that ends the cycle reaches us.
+        // The grab goes out with the batch and its reply is checked later.
+        m_cycle.active = true;
+        m_cycle.grabWanted = true;
+    }
+    // Next focusable client behind the cursor in MRU order.
+    Client *c = from ? from->next : m_mruHead;
+    for (size_t i = 0; i < m_clients.size(); i++, c = c->next) {
+        if (!c)
+            c = m_mruHead;
+        if (c->focusable()) {
+            m_cycle.cursor = c;
+            focusWindow(c->window);
             return;
         }
     }
 }
 
+void WM::endFocusCycle()
+{
+    if (!m_cycle.active)
+        return;
+    m_cycle.active = false;
+    xcb_ungrab_keyboard(m_conn, XCB_CURRENT_TIME);
+    if (m_cycle.cursor)
+        promoteClient(m_cycle.cursor);
+    m_cycle.cursor = nullptr;
+}
+
+void WM::sendCycleGrab()
+{
+    m_cycle.grabWanted = false;
+    if (!m_cycle.active)
+        return; // settled within the batch that started it
+    m_cycle.grabSeq = xcb_grab_keyboard(m_conn, 0, m_screen->root, XCB_CURRENT_TIME,
+                                        XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC).sequence;
+    expectReply(m_cycle.grabSeq, REPLY_CYCLE_GRAB, XCB_NONE);
+    expectReply(xcb_query_pointer(m_conn, m_screen->root).sequence, REPLY_CYCLE_POINTER, XCB_NONE);
+}
+
 void WM::handleButtonPress(xcb_button_press_event_t *ev)
 {
+    m_lastPointer = { ev->root_x, ev->root_y, true };
     // For exit confirmation and runner dialogs (modal), ignore mouse clicks.
-    if ((m_isExitConfirmationActive && ev->event == m_exitConfirmationWindow) ||
-        (m_isRunnerActive && ev->event == m_runnerWindow))
+    if ((m_exitDialog.active && ev->event == m_exitDialog.window) ||
+        (m_runner.active && ev->event == m_runner.window))
         return;
 
     // If the event is on the help popup, check if the click is within the exit button.
-    if (m_isHelpActive && ev->event == m_helpWindow) {
+    if (m_help.active && ev->event == m_help.window) {
         int x = ev->event_x;
         int y = ev->event_y;
         if (x >= EXIT_BTN_X && x <= EXIT_BTN_X + EXIT_BTN_W &&
@@ -611,162 +2659,318 @@ void WM::handleButtonPress(xcb_button_press_event_t *ev)
         moveStart.start_y = ev->root_y;
         moveStart.orig_x  = geom.x;
         moveStart.orig_y  = geom.y;
+        buildSnapEdges();
     } else if (ev->detail == 3) { // right button => resize
         resizeStart.window       = w;
         resizeStart.start_x      = ev->root_x;
         resizeStart.start_y      = ev->root_y;
         resizeStart.start_width  = geom.width;
         resizeStart.start_height = geom.height;
+    } else {
+        return;
     }
+    // Motion is only selected while a drag is in progress.
+    uint16_t dragMask = XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION
+#ifdef POINTER_MOTION_HINT
+                      | XCB_EVENT_MASK_POINTER_MOTION_HINT
+#endif
+                      ;
+    xcb_grab_pointer_cookie_t ck = xcb_grab_pointer(m_conn, 0, m_screen->root, dragMask,
+                                                    XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
+                                                    XCB_NONE, XCB_NONE, ev->time);
+    xcb_discard_reply(m_conn, ck.sequence);
 }
 
 void WM::handleMotionNotify(xcb_motion_notify_event_t *ev)
 {
+#ifdef POINTER_MOTION_HINT
+    // A hint carries no reliable position; querying it also re-arms the hint.
+    if (ev->detail == XCB_MOTION_HINT) {
+        UniqueXCBReply<xcb_query_pointer_reply_t> qp(
+            xcb_query_pointer_reply(m_conn, xcb_query_pointer(m_conn, m_screen->root), nullptr)
+        );
+        if (qp)
+            dragTo(qp->root_x, qp->root_y);
+        return;
+    }
+#endif
+    dragTo(ev->root_x, ev->root_y);
+}
+
+void WM::dragTo(int rootX, int rootY)
+{
+    m_lastPointer = { rootX, rootY, true };
     if (moveStart.window != XCB_NONE) {
-        int dx = ev->root_x - moveStart.start_x;
-        int dy = ev->root_y - moveStart.start_y;
+        int dx = rootX - moveStart.start_x;
+        int dy = rootY - moveStart.start_y;
         int newX = moveStart.orig_x + dx;
         int newY = moveStart.orig_y + dy;
         auto winGeom = getWindowGeometry(moveStart.window);
-        if (std::abs(newX) < SNAP_THRESHOLD) newX = 0;
-        if (std::abs(newY) < SNAP_THRESHOLD) newY = 0;
-        if (std::abs((newX + winGeom.width) - m_screenWidth) < SNAP_THRESHOLD)
-            newX = m_screenWidth - winGeom.width;
-        if (std::abs((newY + winGeom.height) - m_screenHeight) < SNAP_THRESHOLD)
-            newY = m_screenHeight - winGeom.height;
+        uint64_t t0 = monotonicNs();
+        collectSnapEdges({ newX, newY, winGeom.width, winGeom.height },
+                         m_clients.find(moveStart.window));
+        int snapX = snapOffset(m_snapX, newX, newX + winGeom.width, newY, newY + winGeom.height);
+        int snapY = snapOffset(m_snapY, newY, newY + winGeom.height, newX, newX + winGeom.width);
+        m_snapLatency.record(monotonicNs() - t0);
+        newX += snapX;
+        newY += snapY;
         uint32_t vals[2] = { static_cast<uint32_t>(newX), static_cast<uint32_t>(newY) };
-        xcb_configure_window(m_conn, moveStart.window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y, vals);
-        invalidateGeometryCache(moveStart.window);
-        xcb_flush(m_conn);
+        submitDragGeometry(moveStart.window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y, vals);
     } else if (resizeStart.window != XCB_NONE) {
-        int dx = ev->root_x - resizeStart.start_x;
-        int dy = ev->root_y - resizeStart.start_y;
+        int dx = rootX - resizeStart.start_x;
+        int dy = rootY - resizeStart.start_y;
         uint16_t nw = std::max(static_cast<int>(resizeStart.start_width) + dx, 50);
         uint16_t nh = std::max(static_cast<int>(resizeStart.start_height) + dy, 50);
         uint32_t vals[2] = { nw, nh };
-        xcb_configure_window(m_conn, resizeStart.window, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, vals);
-        invalidateGeometryCache(resizeStart.window);
-        xcb_flush(m_conn);
+        submitDragGeometry(resizeStart.window, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, vals);
+    }
+}
+
+// Apply a drag step now if a refresh interval has passed since the last one,
+// otherwise park it until the pacing timer fires.
+void WM::submitDragGeometry(xcb_window_t w, uint16_t mask, const uint32_t *vals)
+{
+    auto &p = m_dragPacer;
+    p.window  = w;
+    p.mask    = mask;
+    p.vals[0] = vals[0];
+    p.vals[1] = vals[1];
+#ifdef PACED_DRAG
+    uint64_t now = monotonicNs();
+    if (p.timer >= 0 && now - p.lastApplyNs < p.intervalNs) {
+        if (p.pending)
+            m_stats.dragSkipped++;
+        else
+            m_loop.armTimer(p.timer, p.lastApplyNs + p.intervalNs - now);
+        p.pending = true;
+        return;
     }
+#endif
+    p.pending = true;
+    applyPendingDrag();
+}
+
+void WM::applyPendingDrag()
+{
+    auto &p = m_dragPacer;
+    if (!p.pending)
+        return;
+    configureWindow(p.window, p.mask, p.vals);
+    p.pending     = false;
+    p.lastApplyNs = monotonicNs();
+    m_stats.dragApplied++;
 }
 
 void WM::handleButtonRelease(xcb_button_release_event_t *ev)
 {
-    (void)ev;
+    // The release position is final: apply it now rather than next frame.
+    if (moveStart.window != XCB_NONE || resizeStart.window != XCB_NONE) {
+        dragTo(ev->root_x, ev->root_y);
+        if (m_dragPacer.timer >= 0)
+            m_loop.disarmTimer(m_dragPacer.timer);
+        applyPendingDrag();
+        xcb_ungrab_pointer(m_conn, ev->time);
+    }
     moveStart = {};
     resizeStart = {};
 }
 
 void WM::toggleFullscreen(xcb_window_t w)
 {
-    if (w == XCB_NONE) return;
-    bool isFS = false;
-    {
-        UniqueXCBReply<xcb_get_property_reply_t> prop(
-            xcb_get_property_reply(m_conn,
-            xcb_get_property(m_conn, 0, w, NET_WM_STATE, XCB_ATOM_ATOM, 0, 1024),
-            nullptr)
-        );
-        if (prop) {
-            auto *states = static_cast<xcb_atom_t*>(xcb_get_property_value(prop.get()));
-            int len = xcb_get_property_value_length(prop.get()) / sizeof(xcb_atom_t);
-            for (int i = 0; i < len; i++) {
-                if (states[i] == NET_WM_STATE_FULLSCREEN) {
-                    isFS = true;
-                    break;
-                }
-            }
-        }
-    }
-    if (!isFS) {
-        auto g = getWindowGeometry(w);
-        m_originalGeometry[w] = g;
-        xcb_atom_t add[] = { NET_WM_STATE_FULLSCREEN };
-        xcb_ewmh_set_wm_state(&m_ewmh, w, 1, add);
+    Client *c = m_clients.find(w);
+    if (!c) return;
+    setFullscreen(w, *c, !(c->state & STATE_FULLSCREEN));
+}
+
+void WM::setFullscreen(xcb_window_t w, Client &c, bool on)
+{
+    if (on == static_cast<bool>(c.state & STATE_FULLSCREEN))
+        return;
+    const uint16_t mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y |
+                          XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
+    if (on) {
+        c.savedGeometry = getWindowGeometry(w);
+        c.state |= STATE_FULLSCREEN;
         uint32_t vals[4] = { 0, 0, static_cast<uint32_t>(m_screenWidth), static_cast<uint32_t>(m_screenHeight) };
-        xcb_configure_window(m_conn, w, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y |
-                             XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, vals);
+        configureWindow(w, mask, vals);
     } else {
-        auto it = m_originalGeometry.find(w);
-        if (it != m_originalGeometry.end()) {
-            auto &g = it->second;
+        c.state &= ~STATE_FULLSCREEN;
+        if (c.savedGeometry) {
+            const auto &g = *c.savedGeometry;
             uint32_t vals[4] = { static_cast<uint32_t>(g.x), static_cast<uint32_t>(g.y), g.width, g.height };
-            xcb_configure_window(m_conn, w, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y |
-                             XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, vals);
-            m_originalGeometry.erase(w);
+            configureWindow(w, mask, vals);
+            c.savedGeometry.reset();
         }
-        xcb_atom_t rm[] = { NET_WM_STATE_FULLSCREEN };
-        xcb_ewmh_set_wm_state(&m_ewmh, w, 0, rm);
     }
-    invalidateGeometryCache(w);
-    xcb_flush(m_conn);
+    writeNetWmState(w, c);
+}
+
+void WM::setClientState(xcb_window_t w, uint32_t bits, bool on)
+{
+    Client *c = m_clients.find(w);
+    if (!c) return;
+    uint32_t state = on ? (c->state | bits) : (c->state & ~bits);
+    if (state == c->state) return;
+    c->state = state;
+    c->stateFetch = 0; // our write is newer than any read in flight
+    writeNetWmState(w, *c);
+}
+
+// Publish the cached bitset as the whole _NET_WM_STATE property.
+void WM::writeNetWmState(xcb_window_t w, Client &c)
+{
+    xcb_atom_t atoms[NUM_NET_WM_STATES];
+    uint32_t n = 0;
+    for (size_t i = 0; i < NUM_NET_WM_STATES; i++) {
+        if (c.state & (1u << i))
+            atoms[n++] = m_atoms[ATOM_NET_WM_STATE_FIRST + i];
+    }
+    track(xcb_change_property(m_conn, XCB_PROP_MODE_REPLACE, w, m_atoms[ATOM_NET_WM_STATE],
+                              XCB_ATOM_ATOM, 32, n, atoms),
+          XCB_CHANGE_PROPERTY);
+    c.pendingStateWrites++;
+}
+
+uint32_t WM::protocolsFromAtoms(const xcb_atom_t *atoms, uint32_t len) const
+{
+    uint32_t protocols = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        if (atoms[i] == m_atoms[ATOM_WM_DELETE_WINDOW])  protocols |= PROTO_DELETE_WINDOW;
+        else if (atoms[i] == m_atoms[ATOM_WM_TAKE_FOCUS]) protocols |= PROTO_TAKE_FOCUS;
+        else if (atoms[i] == m_atoms[ATOM_NET_WM_PING])   protocols |= PROTO_PING;
+    }
+    return protocols;
+}
+
+bool WM::supportsProtocol(xcb_window_t w, uint32_t proto) const
+{
+    const Client *c = m_clients.find(w);
+    return c && (c->protocols & proto);
+}
+
+void WM::sendProtocolMessage(xcb_window_t w, xcb_atom_t protocol)
+{
+    xcb_client_message_event_t cme = {};
+    cme.response_type = XCB_CLIENT_MESSAGE;
+    cme.window = w;
+    cme.type = m_atoms[ATOM_WM_PROTOCOLS];
+    cme.format = 32;
+    cme.data.data32[0] = protocol;
+    cme.data.data32[1] = XCB_CURRENT_TIME;
+    track(xcb_send_event(m_conn, false, w, XCB_EVENT_MASK_NO_EVENT, reinterpret_cast<char*>(&cme)),
+          XCB_SEND_EVENT);
 }
 
-void WM::createPopUpWindow(const char* title, xcb_window_t &winVar,
-                           uint16_t width, uint16_t height, bool &activeFlag)
+uint32_t WM::stateFromAtoms(const xcb_atom_t *atoms, uint32_t len) const
 {
-    if (activeFlag)
+    uint32_t state = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        for (size_t b = 0; b < NUM_NET_WM_STATES; b++) {
+            if (atoms[i] == m_atoms[ATOM_NET_WM_STATE_FIRST + b]) {
+                state |= 1u << b;
+                break;
+            }
+        }
+    }
+    return state;
+}
+
+void WM::preparePopUp(PopUp &p, const char *title)
+{
+    p.record = std::make_unique<Client>();
+    p.record->title = title;
+}
+
+void WM::createPopUpWindow(PopUp &p, uint16_t width, uint16_t height)
+{
+    if (p.active || !p.record)
         return;
-    activeFlag = true;
-    winVar = xcb_generate_id(m_conn);
+    const std::string &title = p.record->title;
+    p.active = true;
+    p.width  = width;
+    p.height = height;
+    p.window = xcb_generate_id(m_conn);
     int x = (m_screenWidth - width) / 2;
     int y = (m_screenHeight - height) / 2;
-    uint32_t mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
+    // No background: the server must not clear what the pixmap repaints.
+    uint32_t mask = XCB_CW_BACK_PIXMAP | XCB_CW_EVENT_MASK;
     uint32_t vals[2] = {
-        BACKGROUND_COLOR,
+        XCB_BACK_PIXMAP_NONE,
         XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS |
-        XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE
+        XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE |
+        XCB_EVENT_MASK_FOCUS_CHANGE
     };
     xcb_create_window(m_conn, m_screen->root_depth,
-                      winVar, m_screen->root,
+                      p.window, m_screen->root,
                       x, y, width, height, 0,
                       XCB_WINDOW_CLASS_INPUT_OUTPUT,
                       m_screen->root_visual,
                       mask, vals);
     xcb_change_property(m_conn, XCB_PROP_MODE_REPLACE,
-                        winVar, XCB_ATOM_WM_NAME,
+                        p.window, XCB_ATOM_WM_NAME,
                         XCB_ATOM_STRING, 8,
-                        std::strlen(title), title);
-    xcb_map_window(m_conn, winVar);
-    m_windowList.push_back(winVar);
-    m_currentWindowIndex = m_windowList.size() - 1;
-    focusWindow(winVar);
-    xcb_flush(m_conn);
+                        title.size(), title.c_str());
+    p.pixmap = xcb_generate_id(m_conn);
+    xcb_create_pixmap(m_conn, m_screen->root_depth, p.pixmap, p.window, width, height);
+    renderPopUp(p); // ready before the first Expose
+    xcb_map_window(m_conn, p.window);
+    Client &c = adoptClient(p.window, std::move(p.record));
+    c.geom  = { x, y, width, height };
+    updateGrid(c);
+    c.mapPending = true;
+    focusWindow(p.window);
 }
 
-void WM::destroyPopUpWindow(xcb_window_t &winVar, bool &activeFlag)
+void WM::destroyPopUpWindow(PopUp &p)
 {
-    if (!activeFlag || winVar == XCB_NONE)
+    if (!p.active || p.window == XCB_NONE)
         return;
-    xcb_unmap_window(m_conn, winVar);
-    xcb_destroy_window(m_conn, winVar);
-    m_windowList.erase(std::remove(m_windowList.begin(), m_windowList.end(), winVar), m_windowList.end());
-    if (m_currentWindowIndex >= m_windowList.size())
-        m_currentWindowIndex = 0;
-    winVar    = XCB_NONE;
-    activeFlag = false;
-    xcb_flush(m_conn);
+    xcb_unmap_window(m_conn, p.window);
+    xcb_destroy_window(m_conn, p.window);
+    m_render.release(p.pixmap);
+    xcb_free_pixmap(m_conn, p.pixmap);
+    // Take the record back, cleared but for its title, for the next open.
+    std::unique_ptr<Client> record = detachClient(p.window);
+    if (record) {
+        std::string title = std::move(record->title);
+        *record = Client{};
+        record->title = std::move(title);
+    }
+    p = PopUp{};
+    p.record = std::move(record);
     resetFocus();
 }
 
 void WM::resetFocus()
 {
-    if (!m_windowList.empty())
-        focusWindow(m_windowList.back());
-    else {
-        xcb_set_input_focus(m_conn, XCB_INPUT_FOCUS_POINTER_ROOT, m_screen->root, XCB_CURRENT_TIME);
-        xcb_flush(m_conn);
+#ifdef FOCUS_FOLLOWS_MOUSE
+    // Sloppy focus: the window now under the pointer, if any.
+    if (m_lastPointer.known) {
+        if (Client *c = clientAt(m_lastPointer.x, m_lastPointer.y)) {
+            focusWindow(c->window);
+            return;
+        }
     }
+#endif
+    // Most recently used window that is still mapped, else the root.
+    for (Client *c = m_mruHead; c; c = c->next) {
+        if (c->focusable()) {
+            focusWindow(c->window);
+            return;
+        }
+    }
+    xcb_set_input_focus(m_conn, XCB_INPUT_FOCUS_POINTER_ROOT, m_screen->root, XCB_CURRENT_TIME);
+    m_focusedWindow = XCB_NONE;
 }
 
 // For exit confirmation and runner dialogs (unchanged)
 void WM::createExitConfirmationDialog()
 {
-    createPopUpWindow("Confirm Exit", m_exitConfirmationWindow, 300, 100, m_isExitConfirmationActive);
+    createPopUpWindow(m_exitDialog, EXIT_DIALOG_WIDTH, EXIT_DIALOG_HEIGHT);
 }
 void WM::destroyExitConfirmationDialog()
 {
-    destroyPopUpWindow(m_exitConfirmationWindow, m_isExitConfirmationActive);
+    destroyPopUpWindow(m_exitDialog);
 }
 void WM::handleExitConfirmationKeypress(xcb_keysym_t ks)
 {
@@ -778,88 +2982,104 @@ void WM::handleExitConfirmationKeypress(xcb_keysym_t ks)
 
 void WM::createRunnerDialog()
 {
-    if (m_isExitConfirmationActive)
+    if (m_exitDialog.active)
         return;
-    createPopUpWindow("Run Program", m_runnerWindow, RUNNER_WIDTH, RUNNER_HEIGHT, m_isRunnerActive);
     m_runnerInput.clear();
+    createPopUpWindow(m_runner, RUNNER_WIDTH, RUNNER_HEIGHT);
 }
 void WM::destroyRunnerDialog()
 {
-    destroyPopUpWindow(m_runnerWindow, m_isRunnerActive);
+    destroyPopUpWindow(m_runner);
     m_runnerInput.clear();
 }
 
 void WM::createHelpPopup()
 {
     // Create the help popup regardless of other modals.
-    createPopUpWindow("Key Bindings", m_helpWindow, HELP_WIDTH, HELP_HEIGHT, m_isHelpActive);
+    createPopUpWindow(m_help, HELP_WIDTH, HELP_HEIGHT);
 }
 void WM::destroyHelpPopup()
 {
-    destroyPopUpWindow(m_helpWindow, m_isHelpActive);
+    destroyPopUpWindow(m_help);
 }
 
-void WM::drawText(xcb_window_t win, const char* fontName, const char* text,
-                  int x, int y, uint32_t fgColor, uint32_t bgColor)
+void WM::handleExpose(xcb_expose_event_t *ev)
 {
-    xcb_gcontext_t gc = xcb_generate_id(m_conn);
-    xcb_font_t font = xcb_generate_id(m_conn);
-    xcb_open_font(m_conn, font, std::strlen(fontName), fontName);
-    uint32_t mask = XCB_GC_FOREGROUND | XCB_GC_BACKGROUND | XCB_GC_FONT;
-    uint32_t vals[3] = { fgColor, bgColor, font };
-    xcb_create_gc(m_conn, gc, win, mask, vals);
-    size_t len = std::strlen(text);
-    xcb_image_text_8(m_conn, len, win, gc, x, y, text);
-    xcb_close_font(m_conn, font);
-    xcb_free_gc(m_conn, gc);
-    xcb_flush(m_conn);
+    PopUp *p = nullptr;
+    for (PopUp *candidate : { &m_runner, &m_exitDialog, &m_help }) {
+        if (candidate->active && candidate->window == ev->window)
+            p = candidate;
+    }
+    if (!p)
+        return;
+    // Collect the series; count says how many more Exposes follow.
+    p->damage.add({ static_cast<int16_t>(ev->x), static_cast<int16_t>(ev->y), ev->width, ev->height });
+    if (ev->count > 0) {
+        m_stats.exposesCoalesced++;
+        return;
+    }
+    m_render.copyRegion(p->pixmap, p->window, p->damage);
+    p->damage.clear();
+    m_stats.exposeRepaints++;
 }
 
-void WM::handleExpose(xcb_expose_event_t *ev)
+// Paint the whole dialog into its pixmap.
+void WM::renderPopUp(PopUp &p)
 {
-    xcb_window_t w = ev->window;
-    if (m_isRunnerActive && w == m_runnerWindow) {
-        fillRect(m_conn, w, 0, 0, ev->width, ev->height, BACKGROUND_COLOR);
-        int textY = RUNNER_HEIGHT / 2 + 10;
-        drawText(w, RUNNER_FONT, m_runnerInput.c_str(), 10, textY, FOREGROUND_COLOR, BACKGROUND_COLOR);
+    using RC = RenderContext;
+    xcb_pixmap_t d = p.pixmap;
+    if (&p == &m_runner) {
+        const auto &m = m_render.metrics(RC::FONT_RUNNER);
+        m_render.fillRect(d, 0, 0, RUNNER_WIDTH, RUNNER_HEIGHT, BACKGROUND_COLOR);
+        int baseline = (RUNNER_HEIGHT - m.height()) / 2 + m.ascent;
+        m_render.drawText(d, RC::FONT_RUNNER, m_runnerInput.c_str(), TEXT_PAD, baseline,
+                          FOREGROUND_COLOR, BACKGROUND_COLOR);
+        int cx, cy, cw, ch;
+        runnerCaretRect(cx, cy, cw, ch);
+        m_render.fillRect(d, cx, cy, cw, ch, FOREGROUND_COLOR);
     }
-    else if (m_isExitConfirmationActive && w == m_exitConfirmationWindow) {
-        fillRect(m_conn, w, 0, 0, ev->width, ev->height, BACKGROUND_COLOR);
+    else if (&p == &m_exitDialog) {
+        const auto &m = m_render.metrics(RC::FONT_DEFAULT);
+        m_render.fillRect(d, 0, 0, EXIT_DIALOG_WIDTH, EXIT_DIALOG_HEIGHT, BACKGROUND_COLOR);
         const char *msg = "Exit WM? (Y/N or ESC)";
-        drawText(w, DEFAULT_FONT, msg, 10, ev->height/2, FOREGROUND_COLOR, BACKGROUND_COLOR);
+        int baseline = (EXIT_DIALOG_HEIGHT - m.height()) / 2 + m.ascent;
+        m_render.drawText(d, RC::FONT_DEFAULT, msg, TEXT_PAD, baseline, FOREGROUND_COLOR, BACKGROUND_COLOR);
     }
-    else if (m_isHelpActive && w == m_helpWindow) {
+    else if (&p == &m_help) {
+        const auto &m = m_render.metrics(RC::FONT_DEFAULT);
         // Draw help background and text.
-        fillRect(m_conn, w, 0, 0, ev->width, ev->height, HELP_BG_COLOR);
+        m_render.fillRect(d, 0, 0, HELP_WIDTH, HELP_HEIGHT, HELP_BG_COLOR);
         const char* lines[] = {
             "Alt+F          => Toggle fullscreen",
             "Alt+E          => Close focused window",
             "Alt+Q          => Exit confirmation dialog",
             "Alt+R          => Runner prompt",
-            "Alt+Tab        => Focus next window",
+            "Alt+Tab        => Previously used window",
             "Alt+I          => Show this help popup",
             "Alt+M          => Minimize window",
             "Alt+N          => Restore all minimized"
         };
-        int y = 40;
+        int y = EXIT_BTN_Y + EXIT_BTN_H + TEXT_PAD + m.ascent;
         for (const auto &line : lines) {
-            drawText(w, DEFAULT_FONT, line, 10, y, FOREGROUND_COLOR, HELP_BG_COLOR);
-            y += 20;
+            m_render.drawText(d, RC::FONT_DEFAULT, line, TEXT_PAD, y, FOREGROUND_COLOR, HELP_BG_COLOR);
+            y += m.height() + LINE_SPACING;
         }
-        // Draw Exit button in the top-right corner.
-        fillRect(m_conn, w, EXIT_BTN_X, EXIT_BTN_Y, EXIT_BTN_W, EXIT_BTN_H, 0xFF0000);
-        drawText(w, DEFAULT_FONT, "Exit", EXIT_BTN_X + 5, EXIT_BTN_Y + 15, FOREGROUND_COLOR, 0xFF0000);
+        // Draw Exit button in the top-right corner, label centred.
+        m_render.fillRect(d, EXIT_BTN_X, EXIT_BTN_Y, EXIT_BTN_W, EXIT_BTN_H, 0xFF0000);
+        m_render.drawText(d, RC::FONT_DEFAULT, "Exit",
+                          EXIT_BTN_X + (EXIT_BTN_W - m_render.textWidth(RC::FONT_DEFAULT, 4)) / 2,
+                          EXIT_BTN_Y + (EXIT_BTN_H - m.height()) / 2 + m.ascent,
+                          FOREGROUND_COLOR, 0xFF0000);
     }
 }
 
 #ifdef FOCUS_FOLLOWS_MOUSE
 void WM::handleEnterNotify(xcb_enter_notify_event_t *ev)
 {
-    if (ev->event != XCB_NONE) {
-        if (std::find(m_windowList.begin(), m_windowList.end(), ev->event) != m_windowList.end()) {
-            focusWindow(ev->event);
-        }
-    }
+    m_lastPointer = { ev->root_x, ev->root_y, true };
+    Client *c = m_clients.find(ev->event);
+    if (c && !c->minimized)
+        focusWindow(ev->event);
 }
 #endif
 
@@ -870,90 +3090,366 @@ xcb_keysym_t WM::getKeysym(xcb_keycode_t code, uint16_t state)
     return xcb_key_symbols_get_keysym(m_keysyms, code, col);
 }
 
-void WM::invalidateGeometryCache(xcb_window_t w)
+WM::Client &WM::addClient(xcb_window_t w)
+{
+    if (Client *c = m_clients.find(w))
+        return *c;
+    Client &c = adoptClient(w, std::make_unique<Client>());
+    // Leave room for the dialogs, which must open without allocating.
+    m_clients.reserve(m_clients.size() + POPUP_COUNT);
+    m_grid.reserve(m_clients.size() + POPUP_COUNT);
+    return c;
+}
+
+WM::Client &WM::adoptClient(xcb_window_t w, std::unique_ptr<Client> record)
+{
+    Client &c = m_clients.adopt(w, std::move(record));
+    c.window = w;
+    linkClient(&c, nullptr); // last until it is first focused
+    restackModel(&c, nullptr); // bottom until we raise it ourselves
+    return c;
+}
+
+void WM::removeClient(xcb_window_t w)
+{
+    detachClient(w);
+}
+
+// Unlinks w everywhere and hands back its record.
+std::unique_ptr<WM::Client> WM::detachClient(xcb_window_t w)
+{
+    std::unique_ptr<Client> record;
+    if (Client *c = m_clients.find(w)) {
+        if (c == m_cycle.cursor)
+            m_cycle.cursor = nullptr;
+        unlinkClient(c);
+        unlinkStack(c);
+        m_stackingDirty = true;
+        m_grid.remove(c);
+        record = m_clients.release(w);
+    }
+    if (w == m_focusedWindow)
+        m_focusedWindow = XCB_NONE;
+    return record;
+}
+
+// Insert into the MRU list ahead of `before` (nullptr appends).
+void WM::linkClient(Client *c, Client *before)
+{
+    c->next = before;
+    c->prev = before ? before->prev : m_mruTail;
+    (c->prev ? c->prev->next : m_mruHead) = c;
+    (before ? before->prev : m_mruTail) = c;
+}
+
+void WM::unlinkClient(Client *c)
+{
+    (c->prev ? c->prev->next : m_mruHead) = c->next;
+    (c->next ? c->next->prev : m_mruTail) = c->prev;
+    c->prev = c->next = nullptr;
+}
+
+// Move to the front of the MRU list, except while Alt+Tab is browsing it.
+void WM::promoteClient(Client *c)
+{
+    if (m_cycle.active || c == m_mruHead)
+        return;
+    unlinkClient(c);
+    linkClient(c, m_mruHead);
+}
+
+// Move c directly above `below` in the stacking model (nullptr: bottom).
+// Raising to the top just takes the next serial; anything else renumbers.
+void WM::restackModel(Client *c, Client *below)
+{
+    unlinkStack(c);
+    c->stackBelow = below;
+    c->stackAbove = below ? below->stackAbove : m_stackBottom;
+    (c->stackAbove ? c->stackAbove->stackBelow : m_stackTop) = c;
+    (below ? below->stackAbove : m_stackBottom) = c;
+    if (c == m_stackTop) {
+        c->stackSerial = ++m_stackSerial;
+    } else {
+        m_stackSerial = 0;
+        for (Client *s = m_stackBottom; s; s = s->stackAbove)
+            s->stackSerial = ++m_stackSerial;
+    }
+    m_stackingDirty = true;
+}
+
+void WM::unlinkStack(Client *c)
+{
+    if (!c->stackBelow && m_stackBottom != c)
+        return; // not in the model yet
+    (c->stackBelow ? c->stackBelow->stackAbove : m_stackBottom) = c->stackAbove;
+    (c->stackAbove ? c->stackAbove->stackBelow : m_stackTop) = c->stackBelow;
+    c->stackBelow = c->stackAbove = nullptr;
+}
+
+void WM::raiseClient(Client &c)
+{
+    if (&c == m_stackTop) {
+        m_stats.restacksSkipped++;
+        return;
+    }
+    uint32_t vals[] = { XCB_STACK_MODE_ABOVE };
+    configureWindow(c.window, XCB_CONFIG_WINDOW_STACK_MODE, vals);
+    restackModel(&c, m_stackTop);
+    m_stats.restacks++;
+}
+
+void WM::mapClient(Client &c)
+{
+    if (c.mapped || c.mapPending) {
+        m_stats.mapsSkipped++;
+        return;
+    }
+    track(xcb_map_window(m_conn, c.window), XCB_MAP_WINDOW);
+    c.mapPending = true;
+}
+
+void WM::publishStacking()
+{
+    xcb_window_t *list = m_scratch.alloc<xcb_window_t>(m_clients.size());
+    uint32_t n = 0;
+    for (Client *c = m_stackBottom; c; c = c->stackAbove)
+        list[n++] = c->window;
+    xcb_change_property(m_conn, XCB_PROP_MODE_REPLACE, m_screen->root,
+                        m_atoms[ATOM_NET_CLIENT_LIST_STACKING], XCB_ATOM_WINDOW, 32,
+                        n, list);
+    m_stackingDirty = false;
+}
+
+void WM::updateGrid(Client &c)
+{
+    m_grid.update(&c, { c.geom.x, c.geom.y, c.geom.width, c.geom.height });
+}
+
+void WM::resizeGrid()
+{
+    m_grid.resize(m_screenWidth, m_screenHeight);
+    m_grid.retune();
+}
+
+// Screen minus the struts reserved by mapped docks (panels, taskbars).
+GridRect WM::workArea() const
+{
+    uint32_t left = 0, right = 0, top = 0, bottom = 0;
+    for (const Client *c = m_mruHead; c; c = c->next) {
+        if (!c->mapped || c->windowType != m_atoms[ATOM_NET_WM_WINDOW_TYPE_DOCK])
+            continue;
+        left   = std::max(left,   c->strut[0]);
+        right  = std::max(right,  c->strut[1]);
+        top    = std::max(top,    c->strut[2]);
+        bottom = std::max(bottom, c->strut[3]);
+    }
+    return { static_cast<int>(left), static_cast<int>(top),
+             m_screenWidth - static_cast<int>(left + right),
+             m_screenHeight - static_cast<int>(top + bottom) };
+}
+
+// Screen and work-area edges, once per drag. They span the whole other axis.
+void WM::buildSnapEdges()
+{
+    constexpr int32_t ALL_LO = INT32_MIN / 2, ALL_HI = INT32_MAX / 2;
+    m_snapX.clear();
+    m_snapY.clear();
+    GridRect wa = workArea();
+    m_snapX.add(0, ALL_LO, ALL_HI);
+    m_snapX.add(m_screenWidth, ALL_LO, ALL_HI);
+    m_snapY.add(0, ALL_LO, ALL_HI);
+    m_snapY.add(m_screenHeight, ALL_LO, ALL_HI);
+    m_snapX.add(wa.x, ALL_LO, ALL_HI);
+    m_snapX.add(wa.x + wa.w, ALL_LO, ALL_HI);
+    m_snapY.add(wa.y, ALL_LO, ALL_HI);
+    m_snapY.add(wa.y + wa.h, ALL_LO, ALL_HI);
+    // Room for every window's edges, so drag steps never allocate.
+    m_snapX.reserve(SNAP_FIXED_EDGES + 2 * m_clients.size());
+    m_snapY.reserve(SNAP_FIXED_EDGES + 2 * m_clients.size());
+}
+
+// Edges of the windows r, the dragged window's proposed rectangle, can
+// snap to: only those with an edge closer than SNAP_THRESHOLD to one of
+// r's, which the grid finds without visiting the rest. A window's edges
+// only span its own side.
+void WM::collectSnapEdges(const GridRect &r, const Client *dragged)
+{
+    m_snapX.truncate(SNAP_FIXED_EDGES);
+    m_snapY.truncate(SNAP_FIXED_EDGES);
+    forEachAdjacent(r, SNAP_THRESHOLD, dragged, [&](const Client *c) {
+        const WindowGeometry &g = c->geom;
+        m_snapX.add(g.x,            g.y, g.y + g.height);
+        m_snapX.add(g.x + g.width,  g.y, g.y + g.height);
+        m_snapY.add(g.y,            g.x, g.x + g.width);
+        m_snapY.add(g.y + g.height, g.x, g.x + g.width);
+    });
+}
+
+// Topmost focusable client containing the point.
+WM::Client *WM::clientAt(int x, int y)
+{
+    Client *top = nullptr;
+    m_grid.query({ x, y, 1, 1 }, [&](Client *c) {
+        if (c->focusable() && (!top || c->stackSerial > top->stackSerial))
+            top = c;
+    });
+    return top;
+}
+
+// Visible clients other than `skip` whose rectangle intersects r.
+template<typename F>
+void WM::forEachOverlapping(const GridRect &r, const Client *skip, F &&f)
+{
+    m_grid.query(r, [&](Client *o) {
+        if (o != skip && o->focusable())
+            f(o);
+    });
+}
+
+// Visible clients other than `skip` with an edge closer than `tolerance`
+// to one of r's edges on the same axis, both facing and aligned, while
+// their extents along that edge come within `tolerance` of r's.
+template<typename F>
+void WM::forEachAdjacent(const GridRect &r, int tolerance, const Client *skip, F &&f)
+{
+    const GridRect around = { r.x - tolerance, r.y - tolerance,
+                              r.w + 2 * tolerance, r.h + 2 * tolerance };
+    auto near = [tolerance](int a, int b) { return std::abs(a - b) < tolerance; };
+    forEachOverlapping(around, skip, [&](Client *o) {
+        const GridRect &q = m_grid.rect(o);
+        if (near(q.x, r.x) || near(q.x, r.x + r.w) ||
+            near(q.x + q.w, r.x) || near(q.x + q.w, r.x + r.w) ||
+            near(q.y, r.y) || near(q.y, r.y + r.h) ||
+            near(q.y + q.h, r.y) || near(q.y + q.h, r.y + r.h))
+            f(o);
+    });
+}
+
+// Title changes only mark the record; the name is read when someone asks.
+const std::string &WM::clientTitle(Client &c)
 {
-    m_geometryCache.erase(w);
+    if (c.titleStale) {
+        c.titleStale = false;
+        c.title.clear();
+        xcb_ewmh_get_utf8_strings_reply_t name;
+        xcb_icccm_get_text_property_reply_t legacy;
+        if (xcb_ewmh_get_wm_name_reply(&m_ewmh, xcb_ewmh_get_wm_name(&m_ewmh, c.window), &name, nullptr)) {
+            c.title.assign(name.strings, name.strings_len);
+            xcb_ewmh_get_utf8_strings_reply_wipe(&name);
+        } else if (xcb_icccm_get_wm_name_reply(m_conn, xcb_icccm_get_wm_name(m_conn, c.window),
+                                               &legacy, nullptr)) {
+            c.title.assign(legacy.name, legacy.name_len);
+            xcb_icccm_get_text_property_reply_wipe(&legacy);
+        }
+    }
+    return c.title;
 }
 
 WM::WindowGeometry WM::getWindowGeometry(xcb_window_t w)
 {
-    if (auto it = m_geometryCache.find(w); it != m_geometryCache.end())
-        return it->second;
+    if (const Client *c = m_clients.find(w)) {
+        m_stats.geomHits++;
+        return c->geom;
+    }
+    // Unmanaged window: ask the server, nothing to cache it in.
+    m_stats.geomMisses++;
     UniqueXCBReply<xcb_get_geometry_reply_t> geom(
         xcb_get_geometry_reply(m_conn, xcb_get_geometry(m_conn, w), nullptr)
     );
     if (!geom) {
         return {0, 0, 100, 100};
     }
-    WindowGeometry wg = { geom->x, geom->y, geom->width, geom->height };
-    m_geometryCache[w] = wg;
-    return wg;
+    return { geom->x, geom->y, geom->width, geom->height };
+}
+
+// Send a configure and write the requested geometry straight into the cache.
+void WM::configureWindow(xcb_window_t w, uint16_t mask, const uint32_t *vals)
+{
+    xcb_void_cookie_t ck = xcb_configure_window(m_conn, w, mask, vals);
+    // A client that vanished mid-configure leaves nothing worth keeping.
+    track(ck, XCB_CONFIGURE_WINDOW, [](void *ctx, const xcb_generic_error_t *err) {
+        if (err->error_code == XCB_WINDOW)
+            static_cast<WM*>(ctx)->removeClient(err->resource_id);
+    });
+    Client *c = m_clients.find(w);
+    if (!c)
+        return;
+    auto &g = c->geom;
+    int i = 0;
+    if (mask & XCB_CONFIG_WINDOW_X)      g.x      = static_cast<int32_t>(vals[i++]);
+    if (mask & XCB_CONFIG_WINDOW_Y)      g.y      = static_cast<int32_t>(vals[i++]);
+    if (mask & XCB_CONFIG_WINDOW_WIDTH)  g.width  = static_cast<uint16_t>(vals[i++]);
+    if (mask & XCB_CONFIG_WINDOW_HEIGHT) g.height = static_cast<uint16_t>(vals[i++]);
+    if (i > 0)
+        updateGrid(*c);
+    c->lastConfigureSeq = ck.sequence;
+    c->configureInFlight = true;
+}
+
+void WM::handleConfigureNotify(xcb_configure_notify_event_t *ev)
+{
+    Client *c = m_clients.find(ev->window);
+    if (!c)
+        return;
+    // Notifies for configures older than our newest one describe a geometry
+    // we have already replaced; only the server's answer to it is final.
+    if (c->configureInFlight) {
+        if (static_cast<int16_t>(ev->sequence - static_cast<uint16_t>(c->lastConfigureSeq)) < 0)
+            return;
+        c->configureInFlight = false;
+    }
+    // above_sibling is the window directly below; siblings we don't manage
+    // (override-redirect, our check window) can't be placed and are skipped.
+    // Client restacks were already applied from the ConfigureRequest.
+    Client *below = m_clients.find(ev->above_sibling);
+    if ((below || ev->above_sibling == XCB_NONE) && c->stackBelow != below)
+        restackModel(c, below);
+    auto &g = c->geom;
+    if (g.x != ev->x || g.y != ev->y || g.width != ev->width || g.height != ev->height) {
+        g = { ev->x, ev->y, ev->width, ev->height };
+        updateGrid(*c);
+        m_stats.geomStale++;
+    }
 }
 
 void WM::handleKeyPress(xcb_key_press_event_t *ev)
 {
     if (!ev) return;
     xcb_keysym_t ks = getKeysym(ev->detail, ev->state);
+    // Anything but another Alt+Tab settles an Alt+Tab cycle first.
+    if (ks != XK_Tab || !(ev->state & XCB_MOD_MASK_1))
+        endFocusCycle();
     // Process exit confirmation and runner modals exclusively.
-    if (m_isExitConfirmationActive || m_isRunnerActive) {
-        if (m_isExitConfirmationActive)
+    if (m_exitDialog.active || m_runner.active) {
+        if (m_exitDialog.active)
             handleExitConfirmationKeypress(ks);
-        else if (m_isRunnerActive)
+        else if (m_runner.active)
             handleRunnerInput(ks);
         return;
     }
     // If the key event is for the help popup and Esc is pressed, close it.
-    if (m_isHelpActive && ev->event == m_helpWindow && ks == XK_Escape) {
+    if (m_help.active && ev->event == m_help.window && ks == XK_Escape) {
         destroyHelpPopup();
         return;
     }
     bool altPressed = (ev->state & XCB_MOD_MASK_1);
     if (!altPressed) return;
-    auto getFocusedWindow = [this]() -> xcb_window_t {
-        xcb_get_input_focus_cookie_t ck = xcb_get_input_focus(m_conn);
-        UniqueXCBReply<xcb_get_input_focus_reply_t> rp(
-            xcb_get_input_focus_reply(m_conn, ck, nullptr)
-        );
-        return rp ? rp->focus : XCB_NONE;
-    };
-    xcb_window_t foc = getFocusedWindow();
+#ifdef DEBUG_LOGS
+    verifyTrackedFocus();
+#endif
+    xcb_window_t foc = m_focusedWindow;
     switch (ks) {
         case XK_f:
             toggleFullscreen(foc);
             break;
         case XK_e:
-        {
-            bool hasWMDelete = false;
-            xcb_icccm_get_wm_protocols_reply_t pr;
-            if (xcb_icccm_get_wm_protocols_reply(m_conn,
-                    xcb_icccm_get_wm_protocols(m_conn, foc, WM_PROTOCOLS),
-                    &pr, nullptr))
-            {
-                for (uint32_t i = 0; i < pr.atoms_len; i++) {
-                    if (pr.atoms[i] == WM_DELETE_WINDOW) {
-                        hasWMDelete = true;
-                        break;
-                    }
-                }
-                if (hasWMDelete) {
-                    xcb_client_message_event_t cme = {};
-                    cme.response_type = XCB_CLIENT_MESSAGE;
-                    cme.window = foc;
-                    cme.type = WM_PROTOCOLS;
-                    cme.format = 32;
-                    cme.data.data32[0] = WM_DELETE_WINDOW;
-                    cme.data.data32[1] = XCB_CURRENT_TIME;
-                    xcb_send_event(m_conn, false, foc, 0, reinterpret_cast<char*>(&cme));
-                    xcb_flush(m_conn);
-                }
-                xcb_icccm_get_wm_protocols_reply_wipe(&pr);
-            }
-            if (!hasWMDelete) {
-                xcb_destroy_window(m_conn, foc);
-                xcb_flush(m_conn);
-            }
+            if (foc == XCB_NONE)
+                break;
+            if (supportsProtocol(foc, PROTO_DELETE_WINDOW))
+                sendProtocolMessage(foc, m_atoms[ATOM_WM_DELETE_WINDOW]);
+            else
+                track(xcb_destroy_window(m_conn, foc), XCB_DESTROY_WINDOW);
             break;
-        }
         case XK_q:
             createExitConfirmationDialog();
             break;
@@ -968,85 +3464,196 @@ void WM::handleKeyPress(xcb_key_press_event_t *ev)
             break;
         case XK_m:
             if (foc != XCB_NONE &&
-                foc != m_runnerWindow &&
-                foc != m_exitConfirmationWindow &&
-                foc != m_helpWindow)
+                foc != m_runner.window &&
+                foc != m_exitDialog.window &&
+                foc != m_help.window)
             {
-                m_windowList.erase(std::remove(m_windowList.begin(), m_windowList.end(), foc), m_windowList.end());
-                m_minimizedWindows.push_back(foc);
+                if (Client *c = m_clients.find(foc)) {
+                    c->minimized = true;
+                    unlinkClient(c); // to the back of the focus order
+                    linkClient(c, nullptr);
+                }
+                setClientState(foc, STATE_HIDDEN, true);
                 xcb_unmap_window(m_conn, foc);
                 resetFocus();
             }
             break;
-        case XK_n:
-            for (auto w : m_minimizedWindows) {
-                xcb_map_window(m_conn, w);
-                if (std::find(m_windowList.begin(), m_windowList.end(), w) == m_windowList.end()) {
-                    m_windowList.push_back(w);
-                }
+        case XK_n: {
+            // Focus goes to the most recently used of the restored windows.
+            Client *first = nullptr;
+            for (Client *c = m_mruHead; c; c = c->next) {
+                if (!c->minimized)
+                    continue;
+                c->minimized = false;
+                setClientState(c->window, STATE_HIDDEN, false);
+                // UnmapNotify from Alt+M may still be on its way: map regardless.
+                track(xcb_map_window(m_conn, c->window), XCB_MAP_WINDOW);
+                c->mapPending = true;
+                if (!first)
+                    first = c;
             }
-            m_minimizedWindows.clear();
-            if (!m_windowList.empty()) {
-                focusWindow(m_windowList.back());
+            if (first) {
+                focusWindow(first->window);
             }
             break;
+        }
         default:
             break;
     }
 }
 
+// Only seen while Alt+Tab holds the keyboard: releasing Alt picks the window.
+void WM::handleKeyRelease(xcb_key_release_event_t *ev)
+{
+    if (!m_cycle.active)
+        return;
+    // A release without Mod1 held means we missed Alt going up.
+    xcb_keysym_t ks = getKeysym(ev->detail, ev->state);
+    if (ks == XK_Alt_L || ks == XK_Alt_R || ks == XK_Meta_L || ks == XK_Meta_R ||
+        !(ev->state & XCB_MOD_MASK_1))
+        endFocusCycle();
+}
+
 void WM::handleMapRequest(xcb_map_request_event_t *mr)
 {
+    xcb_window_t w = mr->window;
+    // Send every request adoption needs before waiting on any reply, so a new
+    // window costs one round trip regardless of how many properties we read.
+    auto attrCk  = xcb_get_window_attributes(m_conn, w);
+    auto geomCk  = xcb_get_geometry(m_conn, w);
+    auto protoCk = xcb_icccm_get_wm_protocols(m_conn, w, m_atoms[ATOM_WM_PROTOCOLS]);
+    auto hintsCk = xcb_icccm_get_wm_normal_hints(m_conn, w);
+    auto classCk = xcb_icccm_get_wm_class(m_conn, w);
+    auto typeCk  = xcb_ewmh_get_wm_window_type(&m_ewmh, w);
+    auto stateCk = xcb_ewmh_get_wm_state(&m_ewmh, w);
+    auto nameCk  = xcb_ewmh_get_wm_name(&m_ewmh, w);
+    auto legacyNameCk = xcb_icccm_get_wm_name(m_conn, w);
+    auto strutPCk = xcb_ewmh_get_wm_strut_partial(&m_ewmh, w);
+    auto strutCk  = xcb_ewmh_get_wm_strut(&m_ewmh, w);
+
     UniqueXCBReply<xcb_get_window_attributes_reply_t> attr(
-        xcb_get_window_attributes_reply(m_conn, xcb_get_window_attributes(m_conn, mr->window), nullptr)
+        xcb_get_window_attributes_reply(m_conn, attrCk, nullptr)
+    );
+    UniqueXCBReply<xcb_get_geometry_reply_t> geom(
+        xcb_get_geometry_reply(m_conn, geomCk, nullptr)
     );
-    if (attr && attr->override_redirect) {
-        xcb_map_window(m_conn, mr->window);
+    // Vanished before we could adopt it, or not ours to manage: the
+    // property replies are dropped unread.
+    if (!attr || !geom || attr->override_redirect) {
+        for (unsigned int seq : { protoCk.sequence, hintsCk.sequence, classCk.sequence,
+                                  typeCk.sequence, stateCk.sequence, nameCk.sequence,
+                                  legacyNameCk.sequence, strutPCk.sequence, strutCk.sequence })
+            xcb_discard_reply(m_conn, seq);
+        if (attr && geom)
+            xcb_map_window(m_conn, w);
         return;
     }
-    xcb_map_window(m_conn, mr->window);
-    {
-        uint32_t vals[] = { XCB_STACK_MODE_ABOVE };
-        xcb_configure_window(m_conn, mr->window, XCB_CONFIG_WINDOW_STACK_MODE, vals);
+
+    Client &client = addClient(w);
+    client.geom = { geom->x, geom->y, geom->width, geom->height };
+    updateGrid(client);
+    m_grid.retune(); // cells follow the window sizes
+    client.minimized = false;
+    client.protocols = 0;
+    xcb_icccm_get_wm_protocols_reply_t pr;
+    if (xcb_icccm_get_wm_protocols_reply(m_conn, protoCk, &pr, nullptr)) {
+        client.protocols = protocolsFromAtoms(pr.atoms, pr.atoms_len);
+        xcb_icccm_get_wm_protocols_reply_wipe(&pr);
     }
-    focusWindow(mr->window);
-    if (std::find(m_windowList.begin(), m_windowList.end(), mr->window) == m_windowList.end()) {
-        m_windowList.push_back(mr->window);
-        m_currentWindowIndex = m_windowList.size() - 1;
+    client.hasNormalHints =
+        xcb_icccm_get_wm_normal_hints_reply(m_conn, hintsCk, &client.normalHints, nullptr);
+    xcb_icccm_get_wm_class_reply_t cls;
+    if (xcb_icccm_get_wm_class_reply(m_conn, classCk, &cls, nullptr)) {
+        client.resName  = cls.instance_name ? cls.instance_name : "";
+        client.resClass = cls.class_name ? cls.class_name : "";
+        xcb_icccm_get_wm_class_reply_wipe(&cls);
     }
-#ifdef FOCUS_FOLLOWS_MOUSE
-    {
-        uint32_t enter_mask = XCB_EVENT_MASK_ENTER_WINDOW;
-        xcb_change_window_attributes(m_conn, mr->window, XCB_CW_EVENT_MASK, &enter_mask);
+    xcb_ewmh_get_atoms_reply_t types;
+    if (xcb_ewmh_get_wm_window_type_reply(&m_ewmh, typeCk, &types, nullptr)) {
+        if (types.atoms_len > 0)
+            client.windowType = types.atoms[0];
+        xcb_ewmh_get_atoms_reply_wipe(&types);
     }
+    client.state = 0;
+    xcb_ewmh_get_atoms_reply_t states;
+    if (xcb_ewmh_get_wm_state_reply(&m_ewmh, stateCk, &states, nullptr)) {
+        client.state = stateFromAtoms(states.atoms, states.atoms_len);
+        xcb_ewmh_get_atoms_reply_wipe(&states);
+    }
+    // _NET_WM_STRUT_PARTIAL wins over _NET_WM_STRUT; only the widths matter.
+    xcb_ewmh_wm_strut_partial_t strutP;
+    xcb_ewmh_get_extents_reply_t strutE;
+    if (xcb_ewmh_get_wm_strut_partial_reply(&m_ewmh, strutPCk, &strutP, nullptr)) {
+        uint32_t s[4] = { strutP.left, strutP.right, strutP.top, strutP.bottom };
+        std::copy(s, s + 4, client.strut);
+        xcb_discard_reply(m_conn, strutCk.sequence);
+    } else if (xcb_ewmh_get_wm_strut_reply(&m_ewmh, strutCk, &strutE, nullptr)) {
+        uint32_t s[4] = { strutE.left, strutE.right, strutE.top, strutE.bottom };
+        std::copy(s, s + 4, client.strut);
+    } else {
+        std::fill(client.strut, client.strut + 4, 0);
+    }
+    // _NET_WM_NAME (UTF-8) wins over the legacy WM_NAME.
+    client.title.clear();
+    client.titleStale = false;
+    xcb_ewmh_get_utf8_strings_reply_t name;
+    xcb_icccm_get_text_property_reply_t legacyName;
+    if (xcb_ewmh_get_wm_name_reply(&m_ewmh, nameCk, &name, nullptr)) {
+        client.title.assign(name.strings, name.strings_len);
+        xcb_ewmh_get_utf8_strings_reply_wipe(&name);
+        xcb_discard_reply(m_conn, legacyNameCk.sequence);
+    } else if (xcb_icccm_get_wm_name_reply(m_conn, legacyNameCk, &legacyName, nullptr)) {
+        client.title.assign(legacyName.name, legacyName.name_len);
+        xcb_icccm_get_text_property_reply_wipe(&legacyName);
+    }
+
+    mapClient(client);
+    focusWindow(w); // raises it
+    {
+        uint32_t clientMask = XCB_EVENT_MASK_FOCUS_CHANGE
+                            | XCB_EVENT_MASK_PROPERTY_CHANGE
+#ifdef FOCUS_FOLLOWS_MOUSE
+                            | XCB_EVENT_MASK_ENTER_WINDOW
 #endif
-    auto g = getWindowGeometry(mr->window);
+                            ;
+        track(xcb_change_window_attributes(m_conn, w, XCB_CW_EVENT_MASK, &clientMask),
+              XCB_CHANGE_WINDOW_ATTRIBUTES);
+    }
+    const auto &g = client.geom;
     xcb_configure_notify_event_t ce = {};
     ce.response_type = XCB_CONFIGURE_NOTIFY;
-    ce.event = mr->window;
-    ce.window = mr->window;
+    ce.event = w;
+    ce.window = w;
     ce.x = g.x;
     ce.y = g.y;
     ce.width = g.width;
     ce.height = g.height;
     ce.border_width = 0;
     ce.override_redirect = false;
-    xcb_send_event(m_conn, false, mr->window, XCB_EVENT_MASK_STRUCTURE_NOTIFY, reinterpret_cast<char*>(&ce));
-    xcb_flush(m_conn);
+    xcb_send_event(m_conn, false, w, XCB_EVENT_MASK_STRUCTURE_NOTIFY, reinterpret_cast<char*>(&ce));
 }
 
 void WM::handleDestroyNotify(xcb_destroy_notify_event_t *dn)
 {
-    xcb_window_t w = dn->window;
-    m_windowList.erase(std::remove(m_windowList.begin(), m_windowList.end(), w), m_windowList.end());
-    if (m_currentWindowIndex >= m_windowList.size())
-        m_currentWindowIndex = 0;
-    invalidateGeometryCache(w);
+    removeClient(dn->window);
+}
+
+void WM::handleMapNotify(xcb_map_notify_event_t *mn)
+{
+    if (Client *c = m_clients.find(mn->window)) {
+        c->mapped = true;
+        c->mapPending = false;
+    }
 }
 
 void WM::handleUnmapNotify(xcb_unmap_notify_event_t *un)
 {
-    (void)un;
+    Client *c = m_clients.find(un->window);
+    if (!c || !c->mapped)
+        return;
+    c->mapped = false;
+    if (un->window == m_focusedWindow)
+        resetFocus();
 }
 
 void WM::handleConfigureRequest(xcb_configure_request_event_t *cr)
@@ -1061,22 +3668,132 @@ void WM::handleConfigureRequest(xcb_configure_request_event_t *cr)
     if (mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) vals[i++] = cr->border_width;
     if (mask & XCB_CONFIG_WINDOW_SIBLING)      vals[i++] = cr->sibling;
     if (mask & XCB_CONFIG_WINDOW_STACK_MODE)   vals[i++] = cr->stack_mode;
-    xcb_configure_window(m_conn, cr->window, mask, vals);
-    invalidateGeometryCache(cr->window);
-    xcb_flush(m_conn);
+    configureWindow(cr->window, mask, vals);
+    if (mask & XCB_CONFIG_WINDOW_STACK_MODE) {
+        if (Client *c = m_clients.find(cr->window))
+            applyStackRequest(c, cr);
+    }
+}
+
+// Mirror a forwarded restack in the stacking model. The ConfigureNotify that
+// follows may name an unmanaged sibling (tooltip, menu) that handleConfigureNotify
+// cannot place the client against, which would leave a self-raised client
+// below the old top and make raiseClient skip it. TopIf, BottomIf and
+// Opposite depend on occlusion and are left to the notify.
+void WM::applyStackRequest(Client *c, const xcb_configure_request_event_t *cr)
+{
+    bool hasSibling = cr->value_mask & XCB_CONFIG_WINDOW_SIBLING;
+    Client *sibling = hasSibling ? m_clients.find(cr->sibling) : nullptr;
+    if (hasSibling && (!sibling || sibling == c))
+        return;
+    Client *below;
+    if (cr->stack_mode == XCB_STACK_MODE_ABOVE)
+        below = sibling ? sibling : m_stackTop;
+    else if (cr->stack_mode == XCB_STACK_MODE_BELOW)
+        below = sibling ? sibling->stackBelow : nullptr;
+    else
+        return;
+    if (below != c && c->stackBelow != below)
+        restackModel(c, below);
 }
 
 void WM::handleClientMessage(xcb_client_message_event_t *cm)
 {
-    if (cm->type == WM_PROTOCOLS && cm->data.data32[0] == WM_DELETE_WINDOW) {
+    if (cm->type == m_atoms[ATOM_WM_PROTOCOLS] && cm->data.data32[0] == m_atoms[ATOM_WM_DELETE_WINDOW]) {
         xcb_destroy_window(m_conn, cm->window);
-        xcb_flush(m_conn);
-    } else if (cm->type == m_ewmh._NET_ACTIVE_WINDOW) {
+    } else if (cm->type == m_atoms[ATOM_NET_ACTIVE_WINDOW]) {
         xcb_window_t w = cm->data.data32[1];
         if (w) focusWindow(w);
+    } else if (cm->type == m_atoms[ATOM_NET_WM_STATE]) {
+        Client *c = m_clients.find(cm->window);
+        if (!c) return;
+        const xcb_atom_t fs = m_atoms[ATOM_NET_WM_STATE_FULLSCREEN];
+        if (cm->data.data32[1] != fs && cm->data.data32[2] != fs) return;
+        bool isFS = c->state & STATE_FULLSCREEN;
+        switch (cm->data.data32[0]) {
+            case XCB_EWMH_WM_STATE_REMOVE: setFullscreen(cm->window, *c, false); break;
+            case XCB_EWMH_WM_STATE_ADD:    setFullscreen(cm->window, *c, true);  break;
+            case XCB_EWMH_WM_STATE_TOGGLE: setFullscreen(cm->window, *c, !isFS); break;
+        }
+    }
+}
+
+void WM::handlePropertyNotify(xcb_property_notify_event_t *ev)
+{
+    Client *client = m_clients.find(ev->window);
+    if (!client)
+        return;
+    Client &c = *client;
+    if (ev->atom == m_atoms[ATOM_NET_WM_NAME] || ev->atom == XCB_ATOM_WM_NAME) {
+        c.titleStale = true;
+    } else if (ev->atom == m_atoms[ATOM_NET_WM_STATE]) {
+        // Echo of our own write: the cache is already current.
+        if (c.pendingStateWrites > 0) {
+            c.pendingStateWrites--;
+            return;
+        }
+        c.state = 0;
+        c.stateFetch = 0; // older reads in flight are superseded
+        if (ev->state == XCB_PROPERTY_DELETE)
+            return;
+        c.stateFetch = xcb_ewmh_get_wm_state(&m_ewmh, ev->window).sequence;
+        expectReply(c.stateFetch, REPLY_WM_STATE, ev->window);
+    } else if (ev->atom == m_atoms[ATOM_WM_PROTOCOLS]) {
+        c.protocols = 0;
+        c.protocolsFetch = 0;
+        if (ev->state == XCB_PROPERTY_DELETE)
+            return;
+        c.protocolsFetch =
+            xcb_icccm_get_wm_protocols(m_conn, ev->window, m_atoms[ATOM_WM_PROTOCOLS]).sequence;
+        expectReply(c.protocolsFetch, REPLY_WM_PROTOCOLS, ev->window);
+    } else if (ev->atom == m_atoms[ATOM_NET_WM_STRUT_PARTIAL] ||
+               ev->atom == m_atoms[ATOM_NET_WM_STRUT]) {
+        // Panels may set or change their strut after mapping. Read both,
+        // as at adoption; a deleted one can still leave the other in place.
+        auto partialCk = xcb_ewmh_get_wm_strut_partial(&m_ewmh, ev->window);
+        auto legacyCk  = xcb_ewmh_get_wm_strut(&m_ewmh, ev->window);
+        c.strutFetch = partialCk.sequence;
+        expectReply(partialCk.sequence, REPLY_STRUT_PARTIAL, ev->window);
+        expectReply(legacyCk.sequence, REPLY_STRUT, ev->window);
     }
 }
 
+void WM::handleFocusIn(xcb_focus_in_event_t *ev)
+{
+    // Keyboard grabs (our own Alt bindings included) don't move real focus.
+    if (ev->mode == XCB_NOTIFY_MODE_GRAB || ev->mode == XCB_NOTIFY_MODE_UNGRAB ||
+        ev->detail == XCB_NOTIFY_DETAIL_POINTER)
+        return;
+    m_focusedWindow = ev->event;
+    if (Client *c = m_clients.find(ev->event))
+        promoteClient(c);
+}
+
+void WM::handleFocusOut(xcb_focus_out_event_t *ev)
+{
+    if (ev->mode == XCB_NOTIFY_MODE_GRAB || ev->mode == XCB_NOTIFY_MODE_UNGRAB ||
+        ev->detail == XCB_NOTIFY_DETAIL_POINTER || ev->detail == XCB_NOTIFY_DETAIL_INFERIOR)
+        return;
+    if (ev->event == m_focusedWindow)
+        m_focusedWindow = XCB_NONE;
+}
+
+#ifdef DEBUG_LOGS
+// Debug-only: compare the tracked focus with the server's (one round trip).
+void WM::verifyTrackedFocus()
+{
+    UniqueXCBReply<xcb_get_input_focus_reply_t> rp(
+        xcb_get_input_focus_reply(m_conn, xcb_get_input_focus(m_conn), nullptr)
+    );
+    if (!rp) return;
+    xcb_window_t server = rp->focus;
+    if (server == m_screen->root || server == XCB_INPUT_FOCUS_POINTER_ROOT)
+        server = XCB_NONE;
+    if (server != m_focusedWindow)
+        m_logger.log("Focus mismatch: tracked ", m_focusedWindow, ", server ", server);
+}
+#endif
+
 void WM::handleRunnerInput(xcb_keysym_t ks)
 {
     if (ks == XK_Escape) {
@@ -1087,12 +3804,12 @@ void WM::handleRunnerInput(xcb_keysym_t ks)
     } else if (ks == XK_BackSpace) {
         if (!m_runnerInput.empty()) {
             m_runnerInput.pop_back();
-            redrawRunnerDialog();
+            updateRunnerText(m_runnerInput.size(), m_runnerInput.size() + 1);
         }
     } else {
-        if (ks >= 32 && ks <= 126) {
+        if (ks >= 32 && ks <= 126 && m_runnerInput.size() < RUNNER_MAX_INPUT) {
             m_runnerInput.push_back(static_cast<char>(ks));
-            redrawRunnerDialog();
+            updateRunnerText(m_runnerInput.size() - 1, m_runnerInput.size() - 1);
         }
     }
 }
@@ -1100,12 +3817,17 @@ void WM::handleRunnerInput(xcb_keysym_t ks)
 void WM::executeCommand(const std::string &cmd)
 {
     if (cmd.empty()) return;
+    AllocExempt exempt; // fork() and the child's exec are not hot paths
     pid_t pid = fork();
     if (pid < 0) {
-        m_logger.log("Failed to fork for command: " + cmd);
+        m_logger.log("Failed to fork for command: ", cmd);
         return;
     }
     if (pid == 0) {
+        // The loop's signals are blocked in the WM; don't pass that on.
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
         if (setsid() == -1) _exit(1);
         for (int fd = 0; fd < static_cast<int>(sysconf(_SC_OPEN_MAX)); fd++) {
             close(fd);
@@ -1113,30 +3835,58 @@ void WM::executeCommand(const std::string &cmd)
         execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*)nullptr);
         _exit(1);
     } else {
-        m_logger.log("Launched command: " + cmd + " [PID=" + std::to_string(pid) + "]");
+        m_logger.log("Launched command: ", cmd, " [PID=", pid, "]");
     }
 }
 
-void WM::redrawRunnerDialog()
+// The runner font is fixed-width: character i occupies one cell starting at
+// TEXT_PAD + i * charWidth, and the caret sits at the start of the cell
+// after the last character.
+void WM::runnerCaretRect(int &x, int &y, int &width, int &height) const
 {
-    if (!m_isRunnerActive || m_runnerWindow == XCB_NONE)
+    const auto &m = m_render.metrics(RenderContext::FONT_RUNNER);
+    x      = TEXT_PAD + static_cast<int>(m_runnerInput.size()) * m.charWidth;
+    y      = (RUNNER_HEIGHT - m.height()) / 2;
+    width  = 2;
+    height = m.height();
+}
+
+// Repaint the cells from `from` to the end of the input, plus the cell the
+// old caret sat in (cell oldSize, which is past the end after an erase),
+// then copy only those to the window. Typing or erasing one character
+// touches two cells.
+void WM::updateRunnerText(size_t from, size_t oldSize)
+{
+    if (!m_runner.active)
         return;
-    xcb_expose_event_t ev = {};
-    ev.response_type = XCB_EXPOSE;
-    ev.window = m_runnerWindow;
-    ev.width = RUNNER_WIDTH;
-    ev.height = RUNNER_HEIGHT;
-    xcb_send_event(m_conn, false, m_runnerWindow, XCB_EVENT_MASK_EXPOSURE,
-                   reinterpret_cast<char*>(&ev));
-    xcb_flush(m_conn);
+    using RC = RenderContext;
+    const auto &m = m_render.metrics(RC::FONT_RUNNER);
+    int x0       = TEXT_PAD + static_cast<int>(from) * m.charWidth;
+    size_t end   = std::max(oldSize, m_runnerInput.size());
+    int width    = static_cast<int>(end - from + 1) * m.charWidth;
+    int top      = (RUNNER_HEIGHT - m.height()) / 2;
+    m_render.fillRect(m_runner.pixmap, x0, top, width, m.height(), BACKGROUND_COLOR);
+    if (from < m_runnerInput.size())
+        m_render.drawText(m_runner.pixmap, RC::FONT_RUNNER, m_runnerInput.c_str() + from,
+                          x0, top + m.ascent, FOREGROUND_COLOR, BACKGROUND_COLOR);
+    int cx, cy, cw, ch;
+    runnerCaretRect(cx, cy, cw, ch);
+    m_render.fillRect(m_runner.pixmap, cx, cy, cw, ch, FOREGROUND_COLOR);
+    if (x0 < RUNNER_WIDTH) // text past the right edge is clipped anyway
+        m_render.copyArea(m_runner.pixmap, m_runner.window, x0, top,
+                          std::min(width, RUNNER_WIDTH - x0), m.height());
+    m_runnerKeyPending = true;
 }
 
 /*******************************************************************************
  * Main Function
  ******************************************************************************/
+// Benchmarks include this file for its data structures and bring their own main.
+#ifndef LWM_NO_MAIN
 int main()
 {
-    signal(SIGCHLD, SIG_IGN);
+    // Block before the logger thread exists so only signalfd sees them.
+    EventLoop::blockSignals(LOOP_SIGNALS);
     const char* home = getenv("HOME");
     std::string logPath = home ? std::string(home) + "/lwm.log" : "lwm.log";
     Logger logger(logPath);
@@ -1150,3 +3900,4 @@ int main()
     wm.cleanup();
     return 0;
 }
+#endif // LWM_NO_MAIN